@@ -1,17 +1,108 @@
 #include "../include/erl_comm.h"
 
 #include <string>
+#include <string.h>
 
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sched.h>
+
+#ifdef ERL_COMM_NUMA
+#include <numa.h>
+#endif
+
+#ifdef ERL_COMM_URING
+#include "../include/erl_comm_uring.h"
+#endif
 
 #include "../include/test_conf.h"
 #include "../include/global_err_msg.h"
 
 using std::string;
 
+/**
+ * @fn	static int apply_thread_opt(pthread_attr_t * attr, const erl_comm_thread_opt * opt)
+ *
+ * @brief	Carry thread placement and scheduling options into a thread attribute.
+ *        on failure attr is reset to defaults, so the thread still spawns unplaced rather than half configured.
+ *
+ * @param [in,out]	attr	thread attribute used to spawn the thread.
+ * @param [in]	opt			placement and scheduling options.
+ *
+ * @return	0 if succeeds, EINVAL if numa_node cannot be honored, else the failing pthread error number.
+ */
+
+static int apply_thread_opt(pthread_attr_t * attr, const erl_comm_thread_opt * opt) {
+	int rc = 0;
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	if (opt->cpu >= 0) {
+		CPU_SET(opt->cpu, &cpus);
+	} else if (opt->numa_node >= 0) {
+#ifdef ERL_COMM_NUMA
+		if (numa_available() != -1) {
+			struct bitmask * mask = numa_allocate_cpumask();
+			if (numa_node_to_cpus(opt->numa_node, mask) == 0) {
+				for (unsigned int i = 0; i < mask->size && i < CPU_SETSIZE; ++i) {
+					if (numa_bitmask_isbitset(mask, i)) {
+						CPU_SET(i, &cpus);
+					}
+				}
+			}
+			numa_free_cpumask(mask);
+		}
+#endif
+		// no libnuma, no such node or no cpus on it
+		if (CPU_COUNT(&cpus) == 0) {
+			rc = EINVAL;
+		}
+	}
+
+	if (!rc && CPU_COUNT(&cpus) > 0) {
+		rc = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+	}
+
+	if (!rc && opt->sched_priority > 0) {
+		struct sched_param param;
+		param.sched_priority = opt->sched_priority;
+
+		if ((rc = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED)) == 0 &&
+			(rc = pthread_attr_setschedpolicy(attr, SCHED_FIFO)) == 0) {
+			rc = pthread_attr_setschedparam(attr, &param);
+		}
+	}
+
+	if (rc) {
+		pthread_attr_destroy(attr);
+		pthread_attr_init(attr);
+	}
+
+	return rc;
+}
+
+/**
+ * @fn	static void name_thread(pthread_t thread, const erl_comm_thread_opt * opt)
+ *
+ * @brief	Name a spawned thread. names longer than 15 characters are truncated.
+ */
+
+static void name_thread(pthread_t thread, const erl_comm_thread_opt * opt) {
+	if (opt->name != NULL) {
+		char name[16];
+		strncpy(name, opt->name, sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		pthread_setname_np(thread, name);
+	}
+}
+
 #ifdef ERL_COMM_DEBUG
 #include <iostream>
 #include <fstream>
@@ -36,48 +127,149 @@ FILE * log_fd;
  * @param [in,out]	parent  	name of the parent which spawend current process.
  * @param [in,out]	buf			the buffer used to hold message.
  * @param	length				maximum length of the buffer.
+ * @param	opt					construction options. NULL uses erl_comm_default_opt().
  *
  * ### remarks	Awang, 16/01/2014.
  */
 
-tFrame_erl_comm::tFrame_erl_comm(char * nodeName, char * parent, unsigned char *buf, int length) {
+tFrame_erl_comm::tFrame_erl_comm(char * nodeName, char * parent, unsigned char *buf, int length, const erl_comm_opt * opt) {
+	if (opt != NULL) {
+		_opt = *opt;
+	} else {
+		erl_comm_default_opt(&_opt);
+	}
+
 #ifdef ERL_COMM_DEBUG
 	{
 		char logFile[2][128];
-		sprintf(logFile[0], "../log/erl_comm_%d.log", nodeName[4]);
-		sprintf(logFile[1], "../log/erl_comm_%d_c.log", nodeName[4]);
+		int id = (nodeName != NULL) ? nodeName[4] : 0;
+		sprintf(logFile[0], "../log/erl_comm_%d.log", id);
+		sprintf(logFile[1], "../log/erl_comm_%d_c.log", id);
 		stream.open(logFile[0], std::ios::out | std::ios::binary);
 		log_fd = fopen(logFile[1], "wb+");
 	}
 #endif
 	erl_init(NULL, 0);
 
-	struct in_addr addr;
-	char * ip = &nodeName[11];
-	addr.s_addr = inet_addr(/*"172.16.0.66"*/ip);
+	if (_opt.transport == PORT_TRANSPORT) {
+		// port program. master owns the other end of in_fd/out_fd, no distribution set up needed
+		_fd = _opt.in_fd;
+		_out_fd = _opt.out_fd;
+	} else {
+		struct in_addr addr;
+		char * ip = &nodeName[11];
+		addr.s_addr = inet_addr(/*"172.16.0.66"*/ip);
+
+		//string fullName = string(nodeName) + string("@172.16.0.66");
+
+		if (erl_connect_xinit(nodeName, nodeName, /*(char *) fullName.c_str()*/nodeName, &addr, (char *) string(DEFAULT_COOKIE).c_str(), 0) == -1) {
+			erl_err_quit("erl_connect_init");
+		}
 
-	//string fullName = string(nodeName) + string("@172.16.0.66");
+		_fd = _out_fd = erl_connect(parent);
 
-	if (erl_connect_xinit(nodeName, nodeName, /*(char *) fullName.c_str()*/nodeName, &addr, (char *) string(DEFAULT_COOKIE).c_str(), 0) == -1) {
-		erl_err_quit("erl_connect_init");
+		// same identity erl_interface sends from. fan-out writes pre-encoded frames through ei directly
+		memset(&_self, 0, sizeof(_self));
+		strncpy(_self.node, erl_thisnodename(), sizeof(_self.node) - 1);
+		_self.creation = erl_thiscreation();
 	}
 
-	_fd = erl_connect(parent);
 	_buf = buf;
 	_length = length;
+
+	// io_uring takes over the C node socket once the connection is up
+	_uring = NULL;
+#ifdef ERL_COMM_URING
+	if (_opt.uring && _opt.transport == CNODE_TRANSPORT && _fd >= 0) {
+		_uring = new tFrame_erl_uring(_fd, _length, _opt.uring_entries, _opt.uring_send_batch);
+		if (!_uring->ready()) {
+#ifdef ERL_COMM_DEBUG
+			stream << "io_uring not available. falling back to socket calls" << endl;
+#endif
+			delete _uring;
+			_uring = NULL;
+		}
+	}
+#endif
 	_recv_cir_ptr = 0;
 	_recv_read_ptr = 0;
 
 	_erl_receive_loop = true;
+	_recv_started = _recv_stop = false;
 	_recv_ret = _send_ret = -1;
+	memset(&emsg, 0, sizeof(emsg));
 	_mt = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_init(&_out_mt, NULL);
+	_peer_cnt = 0;
 	pthread_attr_init(&thread_attr);
+	pthread_attr_init(&send_thread_attr);
+
+	int rc;
+	_init_ret = NO_ERROR;
+	if ((rc = apply_thread_opt(&thread_attr, &_opt.recv_thread)) != 0) {
+#ifdef ERL_COMM_DEBUG
+		stream << "receive thread options rejected " << rc << ". spawning with defaults" << endl;
+#endif
+		_init_ret = ARG_ERROR;
+	}
+	if ((rc = apply_thread_opt(&send_thread_attr, &_opt.send_thread)) != 0) {
+#ifdef ERL_COMM_DEBUG
+		stream << "send thread options rejected " << rc << ". spawning with defaults" << endl;
+#endif
+		_init_ret = ARG_ERROR;
+	}
+
+	// receive ring lives on the node its producer, the receive thread, runs on.
+	// without ERL_COMM_NUMA it is first touched here, so it lands on the constructing thread's node
+	recv_cir_buf = NULL;
+#ifdef ERL_COMM_NUMA
+	_recv_node = _opt.recv_thread.numa_node;
+	if (numa_available() != -1) {
+		if (_recv_node < 0 && _opt.recv_thread.cpu >= 0) {
+			_recv_node = numa_node_of_cpu(_opt.recv_thread.cpu);
+		}
+
+		if (_recv_node >= 0) {
+			recv_cir_buf = (erl_comm_recv_arg *) numa_alloc_onnode(sizeof(erl_comm_recv_arg) * CIR_BUF_SIZE, _recv_node);
+		}
+	}
+#endif
+	if (recv_cir_buf == NULL) {
+		_recv_node = -1;
+		recv_cir_buf = (erl_comm_recv_arg *) malloc(sizeof(erl_comm_recv_arg) * CIR_BUF_SIZE);
+		if (recv_cir_buf == NULL) {
+			erl_err_quit("recv_cir_buf");
+		}
+	}
+	memset(recv_cir_buf, 0, sizeof(erl_comm_recv_arg) * CIR_BUF_SIZE);
 
 	data_access_start();
 	for (int i = 0; i < CIR_BUF_SIZE; ++i) {
 		recv_cir_buf[i].type = NUM_RECV_ARG_TYPE;
 	}
 	data_access_end();
+
+	erl_comm_clock_init(&_clock, _opt.clock);
+
+	// flow control set up. master is granted the receive window up front.
+	if (_opt.recv_window > CIR_BUF_SIZE) {
+		_opt.recv_window = CIR_BUF_SIZE;
+	} else if (_opt.recv_window < 1) {
+		_opt.recv_window = 1;
+	}
+
+	if (_opt.grant_threshold <= 0 || _opt.grant_threshold > _opt.recv_window) {
+		_opt.grant_threshold = _opt.recv_window;
+	}
+
+	_send_credit = _opt.send_window;
+	_recv_drained = 0;
+	pthread_mutex_init(&_credit_mt, NULL);
+	pthread_cond_init(&_credit_cv, NULL);
+
+	if (_opt.flow_ctrl) {
+		_grant_credit(_opt.recv_window);
+	}
 }
 
 /**
@@ -92,20 +284,50 @@ tFrame_erl_comm::tFrame_erl_comm(char * nodeName, char * parent, unsigned char *
  */
 
 tFrame_erl_comm::~tFrame_erl_comm() {
-	// erlang term clean up
-	if (emsg.from) {
-		erl_free_term(emsg.from);
+	// receive thread goes first. it uses the terms, mutexes, ring and io_uring torn down below
+	if (_recv_started) {
+		_recv_stop = true;
+#ifdef ERL_COMM_URING
+		if (_uring != NULL) {
+			// io_uring_enter is no cancellation point. wake the thread out of its wait instead
+			_uring->stop();
+		} else
+#endif
+		pthread_cancel(precv);
+		pthread_join(precv, NULL);
 	}
 
-	if (emsg.msg) {
-		erl_free_compound(emsg.msg);
+	// erlang term clean up
+	_release_msg(&emsg);
+
+	// peer connections. service threads block in read, a cancellation point
+	for (int i = 0; i < _peer_cnt; ++i) {
+		pthread_cancel(_peer[i].thread);
+		pthread_join(_peer[i].thread, NULL);
+		close(_peer[i].fd);
+		free(_peer[i].buf);
 	}
 	
 	// pthread clean up
 	pthread_mutex_destroy(&_mt);
+	pthread_mutex_destroy(&_out_mt);
+	pthread_mutex_destroy(&_credit_mt);
+	pthread_cond_destroy(&_credit_cv);
 	pthread_attr_destroy(&thread_attr);
-	pthread_cancel(precv);
+	pthread_attr_destroy(&send_thread_attr);
 	pthread_cancel(psend);
+
+#ifdef ERL_COMM_URING
+	delete _uring;
+#endif
+
+	// receive ring clean up. receive thread was joined above
+#ifdef ERL_COMM_NUMA
+	if (_recv_node >= 0) {
+		numa_free(recv_cir_buf, sizeof(erl_comm_recv_arg) * CIR_BUF_SIZE);
+	} else
+#endif
+	free(recv_cir_buf);
 }
 
 /**
@@ -144,7 +366,8 @@ void * tFrame_erl_comm::staticRecvEntry(void * c) {
 int tFrame_erl_comm::receive() {
 	int rc;
 
-	rc = pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+	// joined by the destructor, which must not free anything under a running receive thread
+	rc = pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_JOINABLE);
 	if (rc) {
 #ifdef ERL_COMM_DEBUG
 		stream << "receive " << rc << " pthread error setdetachstate" << endl;
@@ -152,13 +375,15 @@ int tFrame_erl_comm::receive() {
 		return PTHREAD_ERROR;
 	}
 
-	rc = pthread_create(&precv, &thread_attr, &staticRecvEntry, this);
+	rc = _spawn(&precv, &thread_attr, &staticRecvEntry, this);
 	if (rc) {
 #ifdef ERL_COMM_DEBUG
 		stream << "receive " << rc << " pthread error create" << endl;
 #endif
 		return PTHREAD_ERROR;
 	}
+	name_thread(precv, &_opt.recv_thread);
+	_recv_started = true;
 
 #if 0
 	rc = pthread_detach(precv);
@@ -173,6 +398,31 @@ int tFrame_erl_comm::receive() {
 	return _recv_ret;
 }
 
+/**
+ * @fn	int tFrame_erl_comm::_spawn(pthread_t * thread, pthread_attr_t * attr, void * (*entry)(void *), void * arg)
+ *
+ * @brief	Create a thread with its placement attribute. placement the system refuses only at creation,
+ *          e.g. SCHED_FIFO without CAP_SYS_NICE or a cpu outside the allowed set, resets attr to defaults
+ *          for this and every later spawn and is reported through get_init_status().
+ *
+ * @return	0 if succeeds, else the pthread_create error number.
+ */
+
+int tFrame_erl_comm::_spawn(pthread_t * thread, pthread_attr_t * attr, void * (*entry)(void *), void * arg) {
+	int rc = pthread_create(thread, attr, entry, arg);
+	if (rc == EPERM || rc == EINVAL || rc == ENOTSUP) {
+#ifdef ERL_COMM_DEBUG
+		stream << "thread options refused " << rc << ". spawning with defaults" << endl;
+#endif
+		pthread_attr_destroy(attr);
+		pthread_attr_init(attr);
+		_init_ret = ARG_ERROR;
+		rc = pthread_create(thread, attr, entry, arg);
+	}
+
+	return rc;
+}
+
 /**
  * @fn	void tFrame_erl_comm::_receive()
  *
@@ -186,10 +436,43 @@ int tFrame_erl_comm::receive() {
 
 void tFrame_erl_comm::_receive() {
 	int got = 0;
+	uint64_t stamp = 0;
+#ifdef ERL_COMM_URING
+	unsigned long batch = 0;
+#endif
 	
-	while (1) {
+	while (!_recv_stop) {
 		if (_erl_receive_loop) {
-			got = erl_receive_msg(_fd, _buf, _length, &emsg);
+			if (_opt.transport == PORT_TRANSPORT) {
+				got = _port_receive_msg(&emsg);
+			}
+#ifdef ERL_COMM_URING
+			else if (_uring != NULL) {
+				got = _uring->receive_msg(&emsg);
+				if (got == ERL_ERROR && _uring->closed()) {
+					_recv_ret = IO_ERROR;
+				}
+			}
+#endif
+			else {
+				got = erl_receive_msg(_fd, _buf, _length, &emsg);
+			}
+
+			// one clock read per receive batch. io_uring hands out many messages per batch
+#ifdef ERL_COMM_URING
+			if (_uring != NULL) {
+				if (got == ERL_MSG && batch != _uring->batch()) {
+					batch = _uring->batch();
+					stamp = erl_comm_clock_read(&_clock);
+					erl_comm_clock_rebase(&_clock, stamp);
+				}
+			} else
+#endif
+			if (got == ERL_MSG) {
+				stamp = erl_comm_clock_read(&_clock);
+				erl_comm_clock_rebase(&_clock, stamp);
+			}
+
 			if (got == ERL_TICK) {
 				/**
 				 * ERL_TICK will be handled automatically by erl_interface.
@@ -205,59 +488,89 @@ void tFrame_erl_comm::_receive() {
 #ifdef ERL_COMM_DEBUG
 				stream << "error" << endl;
 #endif
+				if (_recv_ret == IO_ERROR) {
+					// port or socket closed by master. nothing more will arrive
+					break;
+				}
 			} else {
 				/**
 				 * work load when message received
 				 */
-				if (data_access_start()) {
+				int credit = 0;
 
-					if (emsg.type == ERL_REG_SEND) {
+				if (parse_credit_arg(&emsg, &credit)) {
+					/**
+					 * flow control grant from master. consumed here and never queued.
+					 * handled ahead of the ring lock so a busy consumer cannot drop it
+					 */
 #ifdef ERL_COMM_DEBUG
-						stream << "message received. " << emsg.type << "-" << ERL_REG_SEND << endl;
-						fprintf(log_fd, "emsg: %p buffer: %p type: %d name: %s message: ", &emsg, &recv_cir_buf[_recv_cir_ptr], emsg.type, emsg.to_name);
-						erl_print_term(log_fd, emsg.msg);
-						fflush(log_fd);
-						fprintf(log_fd, " to: ");
-						erl_print_term(log_fd, emsg.to);
-						fflush(log_fd);
-						fprintf(log_fd, " from: ");
-						erl_print_term(log_fd, emsg.from);
-						fflush(log_fd);
-						fprintf(log_fd, "\n");
-						fflush(log_fd);
-#endif
-
-						if (!populate_recv_arg(
+					stream << "credit granted " << credit << endl;
+#endif
+					if (credit > 0) {
+						_add_credit(credit);
+					}
+				} else {
+					bool queued = false;
+
+					if (data_access_start()) {
+						if (emsg.type == ERL_REG_SEND) {
 #ifdef ERL_COMM_DEBUG
-												log_fd,
+							stream << "message received. " << emsg.type << "-" << ERL_REG_SEND << endl;
+							fprintf(log_fd, "emsg: %p buffer: %p type: %d name: %s message: ", &emsg, &recv_cir_buf[_recv_cir_ptr], emsg.type, emsg.to_name);
+							erl_print_term(log_fd, emsg.msg);
+							fflush(log_fd);
+							fprintf(log_fd, " to: ");
+							erl_print_term(log_fd, emsg.to);
+							fflush(log_fd);
+							fprintf(log_fd, " from: ");
+							erl_print_term(log_fd, emsg.from);
+							fflush(log_fd);
+							fprintf(log_fd, "\n");
+							fflush(log_fd);
 #endif
-												&emsg,
-												&recv_cir_buf[_recv_cir_ptr]
-												)) {
-						//if (!populate) {
+
+							if (!populate_recv_arg(
+#ifdef ERL_COMM_DEBUG
+													log_fd,
+#endif
+													&emsg,
+													&recv_cir_buf[_recv_cir_ptr]
+													)) {
+							//if (!populate) {
 #ifdef ERL_COMM_DEBUG
-							stream << "GENERIC ERROR detected. check recv arg population.\n" << endl;
+								stream << "GENERIC ERROR detected. check recv arg population.\n" << endl;
 #endif
-							_recv_ret = GENERIC_ERROR;
-						} else {
+								_recv_ret = GENERIC_ERROR;
+							} else {
+								recv_cir_buf[_recv_cir_ptr].stamp = stamp;
+								queued = true;
 #ifdef ERL_COMM_DEBUG
-							stream << "packets parsed. recv_cir_buf[" << _recv_cir_ptr << "]: " << recv_cir_buf[_recv_cir_ptr].type
-									<< " stmp[" << _recv_cir_ptr << "]: " << (long long) recv_cir_buf[_recv_cir_ptr].ts.tv_sec << ":" << recv_cir_buf[_recv_cir_ptr].ts.tv_nsec << endl;
+								stream << "packets parsed. recv_cir_buf[" << _recv_cir_ptr << "]: " << recv_cir_buf[_recv_cir_ptr].type
+										<< " stmp[" << _recv_cir_ptr << "]: " << (unsigned long long) stamp << endl;
 #endif
-							_recv_cir_ptr = (_recv_cir_ptr + 1) % CIR_BUF_SIZE;
+								_recv_cir_ptr = (_recv_cir_ptr + 1) % CIR_BUF_SIZE;
 #if 0
-							if (_recv_cir_ptr > _recv_read_ptr)
+								if (_recv_cir_ptr > _recv_read_ptr)
 #ifdef ERL_COMM_DEBUG
-								stream << "ERROR circular buffer over flow detected. Consider increasing buffer size." << endl;
+									stream << "ERROR circular buffer over flow detected. Consider increasing buffer size." << endl;
 #else
-								fprintf(stderr, "ERROR circular buffer over flow detected. Consider increasing buffer size.\n");
+									fprintf(stderr, "ERROR circular buffer over flow detected. Consider increasing buffer size.\n");
 #endif
 #endif
+							}
 						}
+						data_access_end();
+					} else 
+						_recv_ret = GENERIC_ERROR;
+
+					if (!queued && (emsg.type == ERL_REG_SEND || emsg.type == ERL_SEND)) {
+						// master spent a credit on it all the same. hand it back as if drained
+						_drain_credit(1);
 					}
-					data_access_end();
-				} else 
-					_recv_ret = GENERIC_ERROR;
+				}
+
+				// parsed content lives in the ring slot from here on. hand the terms back
+				_release_msg(&emsg);
 			}
 		}
 	}
@@ -304,7 +617,11 @@ void * tFrame_erl_comm::staticSendEntry(void * package) {
  */
 
 int tFrame_erl_comm::send(ETERM * msg) {
-	if (erl_reg_send(_fd, (char *) string(LOCAL_MASTER_NAME).c_str(), msg) == 0) {
+	if (!_acquire_credit()) {
+		return NO_CREDIT;
+	}
+
+	if (_transmit(msg) != NO_ERROR) {
 		return GENERIC_ERROR;
 	} else return erl_size(msg);
 }
@@ -335,8 +652,11 @@ int tFrame_erl_comm::send(global_msg_t type, size_t size, erl_comm_send_arg * bu
 	package.size = size;
 	package.args = buf;
 
-	printf("%p %d %u %p\n", &package, package.type, (unsigned) package.size, package.args);
-	rc = pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_JOINABLE);
+#ifdef ERL_COMM_DEBUG
+	// stdout carries frames under PORT_TRANSPORT. keep diagnostics off it
+	stream << "send package " << &package << " " << package.type << " " << (unsigned) package.size << " " << package.args << endl;
+#endif
+	rc = pthread_attr_setdetachstate(&send_thread_attr, PTHREAD_CREATE_JOINABLE);
 	if (rc) {
 #ifdef ERL_COMM_DEBUG
 		stream << "send " << rc << " pthread error setdetachstate" << endl;
@@ -344,13 +664,14 @@ int tFrame_erl_comm::send(global_msg_t type, size_t size, erl_comm_send_arg * bu
 		return PTHREAD_ERROR;
 	}
 
-	rc = pthread_create(&psend, &thread_attr, staticSendEntry, (void *) &package);
+	rc = _spawn(&psend, &send_thread_attr, staticSendEntry, (void *) &package);
 	if (rc) {
 #ifdef ERL_COMM_DEBUG
 		stream << "send " << rc << " pthread error create" << endl;
 #endif
 		return PTHREAD_ERROR;
 	}
+	name_thread(psend, &_opt.send_thread);
 
 	rc = pthread_join(psend, &status);
 	if (rc) {
@@ -383,14 +704,7 @@ int tFrame_erl_comm::send(global_msg_t type, size_t size, erl_comm_send_arg * bu
  */
 
 void tFrame_erl_comm::_send(global_msg_t type, size_t size, erl_comm_send_arg * args) {
-	if (size > _length) {
-		_send_ret = ARG_ERROR;
-		return;
-	} else if (type == INIT) {
-		_send_ret = NOT_HANDLED;
-		return;
-	} else if (type == TIMEOUT || type == CRASH || type == FAULT || type == TRACE) {
-		_send_ret = SELF_CONTAINED;
+	if ((_send_ret = _check_send(type, size)) != NO_ERROR) {
 		return;
 	}
 
@@ -404,6 +718,15 @@ void tFrame_erl_comm::_send(global_msg_t type, size_t size, erl_comm_send_arg *
 					);
 	ETERM * resp = erl_mk_tuple(message, 2);
 
+	if (!_acquire_credit()) {
+		_send_ret = NO_CREDIT;
+
+		erl_free_term(message[0]);
+		erl_free_compound(message[1]);
+		erl_free_term(resp);
+		return;
+	}
+
 #ifdef ERL_COMM_DEBUG
 	erl_print_term(log_fd, message[0]);
 	fprintf(log_fd, "\t");
@@ -413,19 +736,540 @@ void tFrame_erl_comm::_send(global_msg_t type, size_t size, erl_comm_send_arg *
 	fprintf(log_fd, "\n\n");
 	fflush(log_fd);
 #endif
-	if (erl_reg_send(_fd, (char *) string(LOCAL_MASTER_NAME).c_str(), resp) == 0) {
+	if (_transmit(resp) != NO_ERROR) {
 		_send_ret = GENERIC_ERROR;
+	} else {
+		// we've encoded $size bytes and 1 extra 32 bit integer for global type. total is size + 4
+		_send_ret = erl_size(resp);
 	}
 
-	// we've encoded $size bytes and 1 extra 32 bit integer for global type. total is size + 4
-	_send_ret = erl_size(resp);
-
 	erl_free_term(message[0]);
 	erl_free_compound(message[1]);
 	erl_free_term(resp);
 	pthread_exit(NULL);
 }
 
+/**
+ * @fn	int tFrame_erl_comm::_check_send(global_msg_t type, size_t size)
+ *
+ * @brief	Decide whether a message of given type and size goes out at all.
+ *
+ * @param	type	The message type.
+ * @param	size	The message size.
+ *
+ * @return	NO_ERROR if the message is to be sent, else the reason it is not.
+ */
+
+int tFrame_erl_comm::_check_send(global_msg_t type, size_t size) {
+	if (size > _length) {
+		return ARG_ERROR;
+	} else if (type == INIT) {
+		return NOT_HANDLED;
+	} else if (type == TIMEOUT || type == CRASH || type == FAULT || type == TRACE) {
+		return SELF_CONTAINED;
+	}
+
+	return NO_ERROR;
+}
+
+/* fan-out definitions */
+
+/**
+ * @fn	erl_comm_frame * tFrame_erl_comm::encode_frame(global_msg_t type, erl_comm_send_arg * args)
+ *
+ * @brief	Encode {type, args} once into a shared frame.
+ *
+ * @param	type			The message type.
+ * @param [in,out]	args	If non-null, pointer to erl_comm_send_arg which holds send args.
+ *
+ * @return	frame holding one reference, NULL if type is not sent (see _check_send) or encoding fails.
+ */
+
+erl_comm_frame * tFrame_erl_comm::encode_frame(global_msg_t type, erl_comm_send_arg * args) {
+	// size is only known once encoded. the frame is sized to fit, so only the type rule applies
+	if (_check_send(type, 0) != NO_ERROR) {
+		return NULL;
+	}
+
+	ETERM * message[2];
+	message[0] = erl_mk_int(type);
+	message[1] = populate_send_arg(
+#ifdef ERL_COMM_DEBUG
+					log_fd,
+#endif
+					args
+					);
+	if (message[1] == NULL) {
+		erl_free_term(message[0]);
+		return NULL;
+	}
+	ETERM * resp = erl_mk_tuple(message, 2);
+
+	erl_comm_frame * frame = (erl_comm_frame *) malloc(sizeof(erl_comm_frame));
+	int len = erl_term_len(resp);
+	if (frame != NULL) {
+		frame->buf = (char *) malloc(len);
+		frame->ref = 1;
+		if (frame->buf == NULL || (frame->len = erl_encode(resp, (unsigned char *) frame->buf)) != len) {
+			free(frame->buf);
+			free(frame);
+			frame = NULL;
+		}
+	}
+
+	erl_free_term(message[0]);
+	erl_free_compound(message[1]);
+	erl_free_term(resp);
+
+	return frame;
+}
+
+erl_comm_frame * tFrame_erl_comm::frame_get(erl_comm_frame * frame) {
+	__sync_fetch_and_add(&frame->ref, 1);
+	return frame;
+}
+
+void tFrame_erl_comm::frame_put(erl_comm_frame * frame) {
+	if (frame != NULL && __sync_sub_and_fetch(&frame->ref, 1) == 0) {
+		free(frame->buf);
+		free(frame);
+	}
+}
+
+/**
+ * @fn	int tFrame_erl_comm::connect_peer(char * node)
+ *
+ * @brief	Open a distribution connection to a peer node to be used as fan-out destination.
+ *          A service thread reads the connection so ticks are answered and the peer keeps it up.
+ *          Anything else the peer sends is discarded.
+ *
+ * @param [in]	node	full name of the peer node.
+ *
+ * @return	fd of the connection, NOT_HANDLED under PORT_TRANSPORT, IO_ERROR if connect fails,
+ *          GENERIC_ERROR if MAX_PEER connections are open or the service thread cannot start.
+ */
+
+int tFrame_erl_comm::connect_peer(char * node) {
+	if (_opt.transport == PORT_TRANSPORT) {
+		return NOT_HANDLED;
+	}
+
+	int fd = erl_connect(node);
+	if (fd < 0) {
+		return IO_ERROR;
+	}
+
+	int rc = GENERIC_ERROR;
+	pthread_mutex_lock(&_out_mt);
+	if (_peer_cnt < MAX_PEER) {
+		peer_t * peer = &_peer[_peer_cnt];
+		peer->instance = this;
+		peer->fd = fd;
+		peer->buf = (unsigned char *) malloc(_length);
+		if (peer->buf != NULL && pthread_create(&peer->thread, NULL, staticPeerEntry, peer) == 0) {
+			pthread_setname_np(peer->thread, "erl_comm_peer");
+			++_peer_cnt;
+			rc = fd;
+		} else {
+			free(peer->buf);
+		}
+	}
+	pthread_mutex_unlock(&_out_mt);
+
+	if (rc < 0) {
+		close(fd);
+	}
+	return rc;
+}
+
+/**
+ * @fn	void * tFrame_erl_comm::staticPeerEntry(void * package)
+ *
+ * @brief	Wrapper funtion for peer service thread spawn.
+ *
+ * @param [in,out]	package	pointer to the peer_t being serviced.
+ */
+
+void * tFrame_erl_comm::staticPeerEntry(void * package) {
+	((tFrame_erl_comm *) ((peer_t *) package)->instance)->_service_peer((peer_t *) package);
+	return NULL;
+}
+
+/**
+ * @fn	void tFrame_erl_comm::_service_peer(peer_t * peer)
+ *
+ * @brief	Read a peer connection until it closes. ticks are answered, messages are dropped.
+ *          the tick reply is written under _out_mt so it cannot land inside a fan-out frame.
+ *
+ * @param [in,out]	peer	the peer connection and its read buffer.
+ */
+
+void tFrame_erl_comm::_service_peer(peer_t * peer) {
+	static const unsigned char tick[4] = {0, 0, 0, 0};
+	unsigned char hdr[4];
+
+	while (1) {
+		size_t done = 0;
+		while (done < sizeof(hdr)) {
+			ssize_t n = read(peer->fd, hdr + done, sizeof(hdr) - done);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			} else if (n <= 0) {
+				break;
+			}
+			done += n;
+		}
+		if (done < sizeof(hdr)) {
+			break;
+		}
+
+		size_t len = ((size_t) hdr[0] << 24) | ((size_t) hdr[1] << 16) | ((size_t) hdr[2] << 8) | hdr[3];
+		if (len == 0) {
+			// no cancellation while _out_mt is held, the destructor would be left with it locked
+			int state;
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+			pthread_mutex_lock(&_out_mt);
+			ssize_t n = write(peer->fd, tick, sizeof(tick));
+			pthread_mutex_unlock(&_out_mt);
+			pthread_setcancelstate(state, NULL);
+			if (n != sizeof(tick)) {
+				break;
+			}
+			continue;
+		}
+
+		// whatever the peer sends is of no use here. read through it in _length chunks
+		done = 0;
+		while (done < len) {
+			size_t want = (len - done < _length) ? len - done : _length;
+			ssize_t n = read(peer->fd, peer->buf, want);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			} else if (n <= 0) {
+				break;
+			}
+			done += n;
+		}
+		if (done < len) {
+			break;
+		}
+	}
+
+#ifdef ERL_COMM_DEBUG
+	stream << "peer on fd " << peer->fd << " gone" << endl;
+#endif
+}
+
+/**
+ * @fn	int tFrame_erl_comm::send(global_msg_t type, size_t size, erl_comm_send_arg * args, const erl_comm_dest * dest, int cnt)
+ *
+ * @brief	Encode message once and send it to every destination.
+ *
+ * @param	type			The message type.
+ * @param	size			The message size.
+ * @param [in,out]	args	If non-null, pointer to erl_comm_send_arg which holds send args.
+ * @param [in]	dest		destinations.
+ * @param	cnt				number of destinations.
+ *
+ * @return	number of destinations written to, or error number.
+ */
+
+int tFrame_erl_comm::send(global_msg_t type, size_t size, erl_comm_send_arg * args, const erl_comm_dest * dest, int cnt) {
+	int rc = _check_send(type, size);
+	if (rc != NO_ERROR) {
+		return rc;
+	}
+
+	erl_comm_frame * frame = encode_frame(type, args);
+	if (frame == NULL) {
+		return GENERIC_ERROR;
+	}
+
+	rc = send(frame, dest, cnt);
+	frame_put(frame);
+
+	return rc;
+}
+
+/**
+ * @fn	int tFrame_erl_comm::send(erl_comm_frame * frame, const erl_comm_dest * dest, int cnt)
+ *
+ * @brief	Send an encoded frame to every destination.
+ *          Destinations are grouped by connection and each group is corked so its writes leave as one batch.
+ *          Sends to LOCAL_MASTER_NAME on the master connection take flow control credit.
+ *
+ * @param [in]	frame	encoded payload. caller keeps its reference.
+ * @param [in]	dest	destinations.
+ * @param	cnt			number of destinations.
+ *
+ * @return	number of destinations written to, or error number.
+ */
+
+int tFrame_erl_comm::send(erl_comm_frame * frame, const erl_comm_dest * dest, int cnt) {
+	if (_opt.transport == PORT_TRANSPORT) {
+		return NOT_HANDLED;
+	} else if (frame == NULL || dest == NULL || cnt < 0) {
+		return ARG_ERROR;
+	}
+
+	int sent = 0;
+	int on = 1, off = 0;
+
+	// credits are taken before the connection lock so a held sender does not stall every other writer
+	bool * allowed = (bool *) malloc(sizeof(bool) * (cnt > 0 ? cnt : 1));
+	if (allowed == NULL) {
+		return GENERIC_ERROR;
+	}
+	for (int i = 0; i < cnt; ++i) {
+		allowed[i] = (dest[i].fd >= 0 && dest[i].fd != _fd) || dest[i].reg_name == NULL
+					|| strcmp(dest[i].reg_name, LOCAL_MASTER_NAME) != 0 || _acquire_credit();
+	}
+
+	pthread_mutex_lock(&_out_mt);
+	for (int i = 0; i < cnt; ++i) {
+		int fd = (dest[i].fd < 0) ? _fd : dest[i].fd;
+
+		// each connection is handled once, at its first destination
+		bool seen = false;
+		for (int j = 0; j < i && !seen; ++j) {
+			seen = (((dest[j].fd < 0) ? _fd : dest[j].fd) == fd);
+		}
+		if (seen) {
+			continue;
+		}
+
+		// io_uring already batches the master connection into single sends. a cork only adds syscalls there
+		bool cork = true;
+#ifdef ERL_COMM_URING
+		cork = !(fd == _fd && _uring != NULL);
+#endif
+		if (cork) {
+			setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+		}
+		for (int j = i; j < cnt; ++j) {
+			if (((dest[j].fd < 0) ? _fd : dest[j].fd) != fd || !allowed[j]) {
+				continue;
+			}
+
+			int rc;
+			if (dest[j].reg_name != NULL) {
+#ifdef ERL_COMM_URING
+				if (fd == _fd && _uring != NULL) {
+					rc = _uring->send_reg(&_self, dest[j].reg_name, frame->buf, frame->len);
+				} else
+#endif
+				rc = ei_send_reg_encoded(fd, &_self, (char *) dest[j].reg_name, frame->buf, frame->len);
+			} else if (dest[j].pid != NULL && ERL_IS_PID(dest[j].pid)) {
+				erlang_pid to;
+				memset(&to, 0, sizeof(to));
+				strncpy(to.node, ERL_PID_NODE(dest[j].pid), sizeof(to.node) - 1);
+				to.num = ERL_PID_NUMBER(dest[j].pid);
+				to.serial = ERL_PID_SERIAL(dest[j].pid);
+				to.creation = ERL_PID_CREATION(dest[j].pid);
+#ifdef ERL_COMM_URING
+				if (fd == _fd && _uring != NULL) {
+					rc = _uring->send_pid(&to, frame->buf, frame->len);
+				} else
+#endif
+				rc = ei_send_encoded(fd, &to, frame->buf, frame->len);
+			} else {
+				continue;
+			}
+
+			if (rc == 0) {
+				++sent;
+			} else {
+#ifdef ERL_COMM_DEBUG
+				stream << "fan-out to destination " << j << " on fd " << fd << " failed" << endl;
+#endif
+				// nothing reached master. the credit taken for it is still ours
+				if (_opt.flow_ctrl && fd == _fd && dest[j].reg_name != NULL && strcmp(dest[j].reg_name, LOCAL_MASTER_NAME) == 0) {
+					_add_credit(1);
+				}
+			}
+		}
+		if (cork) {
+			setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+		}
+	}
+	pthread_mutex_unlock(&_out_mt);
+	free(allowed);
+
+	return sent;
+}
+
+/**
+ * @fn	void tFrame_erl_comm::flush(void)
+ *
+ * @brief	Submit sends the io_uring backend is holding back to fill a batch.
+ */
+
+void tFrame_erl_comm::flush(void) {
+#ifdef ERL_COMM_URING
+	if (_uring != NULL) {
+		_uring->flush();
+	}
+#endif
+}
+
+/* transport definitions */
+
+/**
+ * @fn	int tFrame_erl_comm::_transmit(ETERM * msg)
+ *
+ * @brief	Send msg to master over the transport selected at construction.
+ *
+ * @param [in]	msg	An erlang term to be sent.
+ *
+ * @return	NO_ERROR if sent, GENERIC_ERROR if encoding fails, IO_ERROR if the transport fails.
+ */
+
+int tFrame_erl_comm::_transmit(ETERM * msg) {
+#ifdef ERL_COMM_URING
+	if (_uring != NULL) {
+		int len = erl_term_len(msg);
+		char * enc = (char *) malloc(len);
+		if (enc == NULL || erl_encode(msg, (unsigned char *) enc) != len) {
+			free(enc);
+			return GENERIC_ERROR;
+		}
+
+		int rc = _uring->send_reg(&_self, LOCAL_MASTER_NAME, enc, len);
+		free(enc);
+		return rc;
+	}
+#endif
+
+	if (_opt.transport != PORT_TRANSPORT) {
+		// serialised with fan-out writes on the same connection
+		pthread_mutex_lock(&_out_mt);
+		int rc = erl_reg_send(_fd, (char *) string(LOCAL_MASTER_NAME).c_str(), msg);
+		pthread_mutex_unlock(&_out_mt);
+		return (rc == 0) ? IO_ERROR : NO_ERROR;
+	}
+
+	// {packet, 4}: 4 byte big endian length followed by external term format
+	int len = erl_term_len(msg);
+	unsigned char * frame = (unsigned char *) malloc(len + 4);
+	if (frame == NULL) {
+		return GENERIC_ERROR;
+	}
+
+	if (erl_encode(msg, frame + 4) != len) {
+		free(frame);
+		return GENERIC_ERROR;
+	}
+	frame[0] = (len >> 24) & 0xff;
+	frame[1] = (len >> 16) & 0xff;
+	frame[2] = (len >> 8) & 0xff;
+	frame[3] = len & 0xff;
+
+	int ret = NO_ERROR;
+	size_t done = 0;
+	pthread_mutex_lock(&_out_mt);
+	while (done < (size_t) len + 4) {
+		ssize_t n = write(_out_fd, frame + done, len + 4 - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			ret = IO_ERROR;
+			break;
+		}
+		done += n;
+	}
+	pthread_mutex_unlock(&_out_mt);
+
+	free(frame);
+	return ret;
+}
+
+/**
+ * @fn	int tFrame_erl_comm::_port_receive_msg(ErlMessage * msg)
+ *
+ * @brief	Read one {packet, 4} frame from master and decode it into msg.
+ *
+ * @param [in,out]	msg	receives the decoded term, typed as ERL_REG_SEND.
+ *
+ * @return	ERL_MSG if a term is decoded, ERL_ERROR otherwise. _recv_ret is set to IO_ERROR once the port is closed.
+ */
+
+int tFrame_erl_comm::_port_receive_msg(ErlMessage * msg) {
+	unsigned char hdr[4];
+	size_t len, done = 0;
+
+	while (done < sizeof(hdr)) {
+		ssize_t n = read(_fd, hdr + done, sizeof(hdr) - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			_recv_ret = IO_ERROR;
+			return ERL_ERROR;
+		}
+		done += n;
+	}
+
+	len = ((size_t) hdr[0] << 24) | ((size_t) hdr[1] << 16) | ((size_t) hdr[2] << 8) | hdr[3];
+
+	// oversized frames are drained so the stream stays in sync
+	bool fits = (len <= _length);
+	done = 0;
+	while (done < len) {
+		size_t want = fits ? len - done : ((len - done < _length) ? len - done : _length);
+		ssize_t n = read(_fd, fits ? _buf + done : _buf, want);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			_recv_ret = IO_ERROR;
+			return ERL_ERROR;
+		}
+		done += n;
+	}
+
+	if (!fits || len == 0) {
+		// dropped, but master counted it against its credit
+		_drain_credit(1);
+		return ERL_ERROR;
+	}
+
+	msg->msg = erl_comm_decode(_buf, len);
+	if (msg->msg == NULL) {
+		_drain_credit(1);
+		return ERL_ERROR;
+	}
+
+	msg->type = ERL_REG_SEND;
+	msg->from = NULL;
+	msg->to = NULL;
+	msg->to_name[0] = '\0';
+
+	return ERL_MSG;
+}
+
+/**
+ * @fn	void tFrame_erl_comm::_release_msg(ErlMessage * msg)
+ *
+ * @brief	Free the terms of a received message once it has been parsed.
+ *
+ * @param [in,out]	msg	the received message. term pointers are reset to NULL.
+ */
+
+void tFrame_erl_comm::_release_msg(ErlMessage * msg) {
+	if (msg->msg) {
+		erl_free_compound(msg->msg);
+		msg->msg = NULL;
+	}
+
+	if (msg->from) {
+		erl_free_term(msg->from);
+		msg->from = NULL;
+	}
+
+	if (msg->to) {
+		erl_free_term(msg->to);
+		msg->to = NULL;
+	}
+}
+
 void tFrame_erl_comm::toggel_receive(bool en) {
 	_erl_receive_loop = en;
 }
@@ -460,6 +1304,8 @@ int tFrame_erl_comm::get_recv_buf(erl_comm_recv_arg * buf) {
 	if (!parse_recv_buf(buf, &recv_cir_buf[_recv_read_ptr])) {
 		return -1;
 	} else {
+		// wall clock only for messages actually handed out
+		erl_comm_clock_to_wall(&_clock, buf->stamp, &buf->ts);
 #ifdef ERL_COMM_DEBUG
 		stream << "buffer read: stmp[" << _recv_read_ptr << "] = " << buf->ts.tv_sec << ":" << buf->ts.tv_nsec << endl;
 #endif
@@ -467,9 +1313,11 @@ int tFrame_erl_comm::get_recv_buf(erl_comm_recv_arg * buf) {
 
 	_recv_read_ptr = (_recv_read_ptr + 1) % CIR_BUF_SIZE;
 
+	_drain_credit(1);
+
 	if (_recv_read_ptr == _recv_cir_ptr && recv_cir_buf[_recv_cir_ptr].type != NUM_RECV_ARG_TYPE && data_access_start()) {
 #ifdef ERL_COMM_DEBUG
-		printf("buffer underflow\n");
+		stream << "buffer underflow" << endl;
 #endif
 		for (int i = 0; i < CIR_BUF_SIZE; ++i) {
 			recv_cir_buf[i].type = NUM_RECV_ARG_TYPE;
@@ -481,3 +1329,153 @@ int tFrame_erl_comm::get_recv_buf(erl_comm_recv_arg * buf) {
 
 	return _recv_read_ptr;
 }
+
+/**
+ * @fn	int tFrame_erl_comm::get_init_status(void)
+ *
+ * @brief	Exposes construction status.
+ *
+ * @return	NO_ERROR, or ARG_ERROR if thread options were rejected and the threads spawn with defaults.
+ */
+
+int tFrame_erl_comm::get_init_status(void) {
+	return _init_ret;
+}
+
+/**
+ * @fn	const erl_comm_clock * tFrame_erl_comm::get_clock(void)
+ *
+ * @brief	Exposes receive clock, e.g. to convert erl_comm_recv_arg::stamp with erl_comm_clock_to_mono.
+ */
+
+const erl_comm_clock * tFrame_erl_comm::get_clock(void) {
+	return &_clock;
+}
+
+/* flow control definitions */
+
+/**
+ * @fn	int tFrame_erl_comm::get_send_credit(void)
+ *
+ * @brief	Exposes remaining send credit.
+ *
+ * @return	number of messages allowed before a hold, -1 if flow control is disabled.
+ */
+
+int tFrame_erl_comm::get_send_credit(void) {
+	int credit;
+
+	if (!_opt.flow_ctrl) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&_credit_mt);
+	credit = _send_credit;
+	pthread_mutex_unlock(&_credit_mt);
+
+	return credit;
+}
+
+/**
+ * @fn	bool tFrame_erl_comm::_acquire_credit(void)
+ *
+ * @brief	Take one send credit, holding up to send_hold_ms for master's next grant.
+ *
+ * @return	true if message is allowed to be sent, false if credit is exhausted.
+ */
+
+bool tFrame_erl_comm::_acquire_credit(void) {
+	if (!_opt.flow_ctrl) {
+		return true;
+	}
+
+	pthread_mutex_lock(&_credit_mt);
+	if (_send_credit <= 0 && _opt.send_hold_ms > 0) {
+		struct timeval now;
+		struct timespec deadline;
+
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + _opt.send_hold_ms / 1000;
+		deadline.tv_nsec = now.tv_usec * 1000 + (long) (_opt.send_hold_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (_send_credit <= 0) {
+			if (pthread_cond_timedwait(&_credit_cv, &_credit_mt, &deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+	}
+
+	bool granted = (_send_credit > 0);
+	if (granted) {
+		--_send_credit;
+	}
+	pthread_mutex_unlock(&_credit_mt);
+
+#ifdef ERL_COMM_DEBUG
+	if (!granted) {
+		stream << "send held off. no credit left" << endl;
+	}
+#endif
+
+	return granted;
+}
+
+/**
+ * @fn	void tFrame_erl_comm::_add_credit(int credit)
+ *
+ * @brief	Account a grant received from master and wake any held sender.
+ *
+ * @param	credit	number of granted messages.
+ */
+
+void tFrame_erl_comm::_add_credit(int credit) {
+	pthread_mutex_lock(&_credit_mt);
+	_send_credit += credit;
+	pthread_cond_broadcast(&_credit_cv);
+	pthread_mutex_unlock(&_credit_mt);
+}
+
+/**
+ * @fn	void tFrame_erl_comm::_drain_credit(int cnt)
+ *
+ * @brief	Account messages master sent which are done with, queued or not, and grant them back at threshold.
+ *        called from both receive and consumer threads.
+ *
+ * @param	cnt	number of messages drained.
+ */
+
+void tFrame_erl_comm::_drain_credit(int cnt) {
+	if (!_opt.flow_ctrl) {
+		return;
+	}
+
+	int drained = __sync_add_and_fetch(&_recv_drained, cnt);
+	if (drained >= _opt.grant_threshold && __sync_bool_compare_and_swap(&_recv_drained, drained, 0)) {
+		// on a lost race the other thread sees the threshold crossed and grants instead
+		_grant_credit(drained);
+	}
+}
+
+/**
+ * @fn	void tFrame_erl_comm::_grant_credit(int credit)
+ *
+ * @brief	Grant master credit for more messages. grants bypass send credit accounting.
+ *
+ * @param	credit	number of messages master is allowed to send on top of current grant.
+ */
+
+void tFrame_erl_comm::_grant_credit(int credit) {
+	ETERM * grant = populate_credit_arg(credit);
+
+	if (_transmit(grant) != NO_ERROR) {
+#ifdef ERL_COMM_DEBUG
+		stream << "credit grant " << credit << " failed" << endl;
+#endif
+	}
+
+	erl_free_compound(grant);
+}
@@ -9,10 +9,106 @@
 #include "global_msg_type.h"
 
 #define CIR_BUF_SIZE 1024
+#define MAX_PEER 16    // fan-out peer connections, see connect_peer
+
+class tFrame_erl_uring;
+
+/**
+ * @brief transport toward master, selected at construction.
+ */
+typedef enum erl_comm_transport_e {
+	CNODE_TRANSPORT, // hidden distribution C node. needs epmd, cookie and handshake
+	PORT_TRANSPORT,  // port program speaking {packet, 4} over in_fd/out_fd. node name and parent are unused
+
+	NUM_TRANSPORT
+} erl_comm_transport_t;
+
+/**
+ * @brief placement and scheduling of a worker thread.
+ *        numa_node needs ERL_COMM_NUMA (links libnuma). without it a numa_node is rejected, see get_init_status().
+ */
+typedef struct erl_comm_thread_opt_s {
+	int cpu;             // cpu to pin to. -1 leaves affinity alone
+	int numa_node;       // node to pin to when cpu is -1. -1 leaves affinity alone
+	int sched_priority;  // SCHED_FIFO priority. 0 keeps the inherited policy
+	const char * name;   // thread name, at most 15 characters. NULL keeps the default
+} erl_comm_thread_opt;
+
+/**
+ * @brief construction time options. call erl_comm_default_opt() before overriding fields.
+ */
+typedef struct erl_comm_opt_s {
+	erl_comm_transport_t transport;
+	int in_fd;           // PORT_TRANSPORT only. fd master writes to, stdin by default
+	int out_fd;          // PORT_TRANSPORT only. fd master reads from, stdout by default
+
+	// credit based flow control with LOCAL_MASTER_NAME. disabled keeps the unthrottled behavior.
+	bool flow_ctrl;
+	int recv_window;     // credits granted to master up front. clamped to 1..CIR_BUF_SIZE
+	int grant_threshold; // number of drained slots before credits are granted back to master
+	int send_window;     // send credits assumed before master's first grant
+	int send_hold_ms;    // how long send holds for a credit. 0 fails with NO_CREDIT immediately
+
+	// io_uring backend for the C node socket. only honored when built with ERL_COMM_URING (links liburing).
+	// falls back to plain socket calls when io_uring is not available
+	bool uring;
+	unsigned int uring_entries;  // submission queue depth of the receive and the send ring
+	int uring_send_batch;        // frames queued before a send is submitted. see flush()
+
+	// receive timestamp source. read once per receive batch, converted to wall clock in get_recv_buf
+	erl_comm_clock_t clock;
+
+	// thread placement. with ERL_COMM_NUMA the receive ring is allocated on the receive thread's node,
+	// without it the ring is first touched by, and lands on the node of, the constructing thread
+	erl_comm_thread_opt recv_thread;
+	erl_comm_thread_opt send_thread;
+} erl_comm_opt;
+
+inline void erl_comm_default_opt(erl_comm_opt * opt) {
+	opt->transport = CNODE_TRANSPORT;
+	opt->in_fd = 0;
+	opt->out_fd = 1;
+	opt->flow_ctrl = false;
+	opt->recv_window = CIR_BUF_SIZE / 2;
+	opt->grant_threshold = CIR_BUF_SIZE / 8;
+	opt->send_window = 0;
+	opt->send_hold_ms = 100;
+
+	opt->uring = false;
+	opt->uring_entries = 256;
+	opt->uring_send_batch = 1;
+
+	opt->clock = REALTIME_CLOCK;
+
+	opt->recv_thread.cpu = opt->send_thread.cpu = -1;
+	opt->recv_thread.numa_node = opt->send_thread.numa_node = -1;
+	opt->recv_thread.sched_priority = opt->send_thread.sched_priority = 0;
+	opt->recv_thread.name = "erl_comm_recv";
+	opt->send_thread.name = "erl_comm_send";
+}
+
+/**
+ * @brief fan-out destination. a registered name or a pid behind a connection the node holds.
+ */
+typedef struct erl_comm_dest_s {
+	int fd;                 // connection to send on. -1 for the master connection
+	const char * reg_name;  // registered name on the far node. NULL sends to pid
+	ETERM * pid;            // destination pid when reg_name is NULL
+} erl_comm_dest;
+
+/**
+ * @brief payload encoded once and shared by every destination it is sent to.
+ *        reference counted. the last frame_put frees it.
+ */
+typedef struct erl_comm_frame_s {
+	char * buf;   // external term format, version magic included
+	int len;
+	int ref;
+} erl_comm_frame;
 
 class tFrame_erl_comm {
 public:
-	tFrame_erl_comm(char *, char *, unsigned char *, int);
+	tFrame_erl_comm(char *, char *, unsigned char *, int, const erl_comm_opt * = NULL);
 	~tFrame_erl_comm();
 
 	/**
@@ -40,6 +136,41 @@ public:
 	 */
 	int send(ETERM *);
 
+	/**
+	 * @brief fan-out send. payload is encoded once and only the distribution header is written per destination.
+	 *        destinations sharing a connection are written as one batch. C node transport only.
+	 * @output
+	 *      if success, return number of destinations the frame was written to
+	 *      if not success, return error number. see header definition for error detail
+	 */
+	int send(global_msg_t, size_t, erl_comm_send_arg *, const erl_comm_dest *, int);
+	int send(erl_comm_frame *, const erl_comm_dest *, int);
+
+	/**
+	 * @brief encode given message type and content into a shared frame holding one reference.
+	 * @output
+	 *      NULL if message type is not sent or encoding fails
+	 */
+	erl_comm_frame * encode_frame(global_msg_t, erl_comm_send_arg *);
+	static erl_comm_frame * frame_get(erl_comm_frame *);
+	static void frame_put(erl_comm_frame *);
+
+	/**
+	 * @brief connect to a peer node for fan-out. C node transport only.
+	 *        the connection is read by its own thread so ticks are answered. messages from the peer are dropped.
+	 * @output
+	 *      if success, return fd to be used in erl_comm_dest
+	 *      if not success, return error number. see header definition for error detail
+	 */
+	int connect_peer(char *);
+
+	/**
+	 * @brief submit sends held back for uring_send_batch and wait until they are written.
+	 *        the receive thread does this on its own after about 1ms. without it running, call flush().
+	 *        no-op without the io_uring backend.
+	 */
+	void flush(void);
+
 	/**
 	 * @brief toggel _erl_receive_loop.
 	 * @arg bool en - toggel the controller flag to en.
@@ -54,10 +185,45 @@ public:
 
 	int get_recv_buf(erl_comm_recv_arg *);
 
+	/**
+	 * @brief number of messages which can be sent to master before a hold. -1 if flow control is disabled.
+	 */
+	int get_send_credit(void);
+
+	/**
+	 * @brief construction status. ARG_ERROR if thread options were rejected, at construction or when a
+	 *        thread was spawned. threads then spawn with defaults.
+	 */
+	int get_init_status(void);
+
+	/**
+	 * @brief receive clock, calibrated at construction and rebased by the receive thread.
+	 *        read it through erl_comm_clock_to_wall or erl_comm_clock_to_mono, which take a consistent copy.
+	 */
+	const erl_comm_clock * get_clock(void);
+
 protected:
 
 	void _receive();
+	int _spawn(pthread_t *, pthread_attr_t *, void * (*)(void *), void *);
 	void _send(global_msg_t, size_t, erl_comm_send_arg *);
+	int _check_send(global_msg_t, size_t);
+
+	/**
+	 * @brief transport helpers. _transmit sends msg to master over the selected transport,
+	 *        _port_receive_msg reads one {packet, 4} frame in the same shape erl_receive_msg returns.
+	 */
+	int _transmit(ETERM *);
+	int _port_receive_msg(ErlMessage *);
+	void _release_msg(ErlMessage *);
+
+	/**
+	 * @brief flow control helpers. credits are only accounted when _opt.flow_ctrl is set.
+	 */
+	bool _acquire_credit(void);
+	void _add_credit(int);
+	void _drain_credit(int);
+	void _grant_credit(int);
 
 private:
 	typedef struct send_s {
@@ -67,19 +233,42 @@ private:
 		erl_comm_send_arg * args;
 	} send_t;
 
+	typedef struct peer_s {
+		void * instance;
+		int fd;
+		unsigned char * buf;
+		pthread_t thread;
+	} peer_t;
+
+	static void * staticPeerEntry(void *);
+	void _service_peer(peer_t *);
+
 	unsigned int _length;
-	int _fd, _recv_ret, _send_ret;
+	int _fd, _out_fd, _recv_ret, _send_ret, _init_ret;
 	unsigned char * _buf;
-	bool _erl_receive_loop;
+	bool _erl_receive_loop, _recv_started;
+	volatile bool _recv_stop;
 	char * _parent;
 	ErlMessage emsg;
 	//ETERM * _from;
 	pthread_mutex_t _mt;
+	pthread_mutex_t _out_mt;
+	peer_t _peer[MAX_PEER];
+	int _peer_cnt;
+	erlang_pid _self;
+	tFrame_erl_uring * _uring;
+	erl_comm_clock _clock;
 	pthread_t precv;
 	pthread_t psend;
 	pthread_attr_t thread_attr;
+	pthread_attr_t send_thread_attr;
+
+	erl_comm_recv_arg * recv_cir_buf;
+	int _recv_cir_ptr, _recv_read_ptr, _recv_node;
 
-	erl_comm_recv_arg recv_cir_buf[CIR_BUF_SIZE];
-	int _recv_cir_ptr, _recv_read_ptr;
+	erl_comm_opt _opt;
+	int _send_credit, _recv_drained;
+	pthread_mutex_t _credit_mt;
+	pthread_cond_t _credit_cv;
 };
 #endif
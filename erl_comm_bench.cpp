@@ -0,0 +1,375 @@
+/**
+ * Microbenchmarks for the erl_comm encode/decode/queue primitives.
+ * Every primitive runs in isolation on synthetic messages. No live connection is needed.
+ *
+ * Build next to erl_comm.cpp, without ERL_COMM_DEBUG:
+ *     g++ -O2 -I<erl_interface>/include erl_comm_bench.cpp -L<erl_interface>/lib -lerl_interface -lei -lpthread -o erl_comm_bench
+ *
+ * Run and keep the result of a commit, then compare another commit against it:
+ *     ./erl_comm_bench > bench_output.txt
+ *     ./erl_comm_bench -b bench_output.txt
+ *
+ * Output is one line per primitive: name, ns/op, allocations/op, eterms/op, freelist/op, instructions/op.
+ * allocations/op only sees malloc. erl_interface hands out ETERMs from its own free list, so eterms/op and
+ * freelist/op report the change in ETERMs in use and on that free list, from erl_eterm_statistics().
+ * Anything but 0 there means the primitive leaks terms or grows the free list.
+ * instructions/op reads "-" when perf events are not available (see perf_event_paranoid).
+ */
+
+#include "../include/erl_comm.h"
+
+#include <string>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#ifdef ERL_COMM_DEBUG
+#error "benchmark numbers are meaningless with ERL_COMM_DEBUG logging"
+#endif
+
+#if IMPORT_DEF
+#error "benchmark covers the default erl_comm_recv_arg definition only"
+#endif
+
+#define BENCH_ITER 1000000
+#define BENCH_MAX 32
+
+/* allocation counting. interposes malloc family for this binary, erl_interface included */
+
+extern "C" void * __libc_malloc(size_t);
+extern "C" void * __libc_calloc(size_t, size_t);
+extern "C" void * __libc_realloc(void *, size_t);
+
+static bool count_alloc = false;
+static unsigned long long alloc_cnt = 0;
+
+extern "C" void * malloc(size_t size) {
+	if (count_alloc) {
+		++alloc_cnt;
+	}
+	return __libc_malloc(size);
+}
+
+extern "C" void * calloc(size_t n, size_t size) {
+	if (count_alloc) {
+		++alloc_cnt;
+	}
+	return __libc_calloc(n, size);
+}
+
+extern "C" void * realloc(void * p, size_t size) {
+	if (count_alloc) {
+		++alloc_cnt;
+	}
+	return __libc_realloc(p, size);
+}
+
+/* instruction counting. user space only so kernel noise stays out */
+
+static int insn_fd = -1;
+
+static void insn_open(void) {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	insn_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void insn_start(void) {
+	if (insn_fd >= 0) {
+		ioctl(insn_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(insn_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static long long insn_stop(void) {
+	long long cnt = -1;
+
+	if (insn_fd >= 0) {
+		ioctl(insn_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(insn_fd, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+			cnt = -1;
+		}
+	}
+	return cnt;
+}
+
+/* result bookkeeping */
+
+typedef struct bench_result_s {
+	char name[64];
+	double ns;
+	double allocs;
+	double eterms;    // change of ETERMs in use
+	double freelist;  // change of ETERMs on erl_interface free list
+	double insns;     // negative if not measured
+} bench_result;
+
+static bench_result results[BENCH_MAX];
+static int result_cnt = 0;
+
+static inline void clobber(void) {
+	asm volatile("" ::: "memory");
+}
+
+static inline uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief	Run op BENCH_ITER times and record its per op cost.
+ *
+ * ### param	name	primitive name as printed.
+ * ### param	op  	the primitive under test, called with ctx.
+ * ### param	ctx 	synthetic input for op.
+ */
+
+static void run(const char * name, void (*op)(void *), void * ctx) {
+	bench_result * r = &results[result_cnt++];
+	strncpy(r->name, name, sizeof(r->name) - 1);
+
+	// warm up caches and erl_interface free lists
+	for (int i = 0; i < BENCH_ITER / 10; ++i) {
+		op(ctx);
+	}
+
+	unsigned long eterm_start, free_start, eterm_end, free_end;
+	erl_eterm_statistics(&eterm_start, &free_start);
+
+	alloc_cnt = 0;
+	count_alloc = true;
+	insn_start();
+	uint64_t start = now_ns();
+	for (int i = 0; i < BENCH_ITER; ++i) {
+		op(ctx);
+		clobber();
+	}
+	uint64_t end = now_ns();
+	long long insns = insn_stop();
+	count_alloc = false;
+	erl_eterm_statistics(&eterm_end, &free_end);
+
+	r->ns = (double) (end - start) / BENCH_ITER;
+	r->allocs = (double) alloc_cnt / BENCH_ITER;
+	r->eterms = ((double) eterm_end - (double) eterm_start) / BENCH_ITER;
+	r->freelist = ((double) free_end - (double) free_start) / BENCH_ITER;
+	r->insns = (insns < 0) ? -1 : (double) insns / BENCH_ITER;
+}
+
+/* primitives under test */
+
+typedef struct recv_ctx_s {
+	ErlMessage msg;
+	erl_comm_recv_arg buf;
+} recv_ctx;
+
+static void op_populate_recv_arg(void * c) {
+	recv_ctx * ctx = (recv_ctx *) c;
+	ctx->buf.read_ready = false;
+	populate_recv_arg(&ctx->msg, &ctx->buf);
+}
+
+static void op_populate_send_arg(void * c) {
+	ETERM * msg = populate_send_arg((erl_comm_send_arg *) c);
+	erl_free_compound(msg);
+}
+
+static void op_parse_recv_buf(void * c) {
+	recv_ctx * ctx = (recv_ctx *) c;
+	erl_comm_recv_arg dst;
+	ctx->buf.read_ready = true;
+	ctx->buf.type = UPDATE;
+	parse_recv_buf(&dst, &ctx->buf);
+	clobber();
+}
+
+static void op_timespec_to_erltime(void * c) {
+	struct timespec * ts = (struct timespec *) c;
+	long int sec = ts->tv_sec, usec = ts->tv_nsec, erl_megsec;
+	timespec_to_erltime(sec, usec, erl_megsec);
+	clobber();
+	ts->tv_sec += 1;
+}
+
+static void op_clock_read(void * c) {
+	volatile uint64_t raw = erl_comm_clock_read((erl_comm_clock *) c);
+	(void) raw;
+}
+
+static void op_clock_to_wall(void * c) {
+	erl_comm_clock * clk = (erl_comm_clock *) c;
+	struct timespec ts;
+	erl_comm_clock_to_wall(clk, clk->raw_base + 12345, &ts);
+	clobber();
+}
+
+/* receive ring, indexed the same way tFrame_erl_comm walks recv_cir_buf */
+
+typedef struct ring_ctx_s {
+	ErlMessage msg;
+	erl_comm_recv_arg ring[CIR_BUF_SIZE];
+	int cir_ptr, read_ptr;
+} ring_ctx;
+
+static void op_ring_push_pop(void * c) {
+	ring_ctx * ctx = (ring_ctx *) c;
+	erl_comm_recv_arg dst;
+
+	populate_recv_arg(&ctx->msg, &ctx->ring[ctx->cir_ptr]);
+	ctx->cir_ptr = (ctx->cir_ptr + 1) % CIR_BUF_SIZE;
+
+	parse_recv_buf(&dst, &ctx->ring[ctx->read_ptr]);
+	ctx->read_ptr = (ctx->read_ptr + 1) % CIR_BUF_SIZE;
+	clobber();
+}
+
+/* baseline comparison */
+
+static int load_baseline(const char * path, bench_result * base, int max) {
+	FILE * fp = fopen(path, "r");
+	char line[256];
+	int cnt = 0;
+
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (cnt < max && fgets(line, sizeof(line), fp) != NULL) {
+		char insns[32];
+		if (line[0] == '#') {
+			continue;
+		}
+		if (sscanf(line, "%63s %lf %lf %lf %lf %31s", base[cnt].name, &base[cnt].ns, &base[cnt].allocs,
+				&base[cnt].eterms, &base[cnt].freelist, insns) == 6) {
+			base[cnt].insns = (insns[0] == '-') ? -1 : atof(insns);
+			++cnt;
+		}
+	}
+
+	fclose(fp);
+	return cnt;
+}
+
+// eterm counts are signed, so only the absolute change is meaningful
+static void print_diff(const char * label, double now, double was) {
+	printf(" %s %+.2f", label, now - was);
+}
+
+static void print_delta(const char * label, double now, double was) {
+	if (now < 0 || was < 0) {
+		printf(" %s -", label);
+	} else if (was == 0) {
+		printf(" %s %+.2f", label, now - was);
+	} else {
+		printf(" %s %+.1f%%", label, (now - was) * 100.0 / was);
+	}
+}
+
+int main(int argc, char ** argv) {
+	const char * baseline = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:")) != -1) {
+		if (opt == 'b') {
+			baseline = optarg;
+		} else {
+			fprintf(stderr, "usage: %s [-b baseline]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	erl_init(NULL, 0);
+	insn_open();
+
+	recv_ctx update_ctx, kill_ctx;
+	memset(&update_ctx, 0, sizeof(update_ctx));
+	memset(&kill_ctx, 0, sizeof(kill_ctx));
+	update_ctx.msg.type = ERL_REG_SEND;
+	update_ctx.msg.msg = erl_format((char *) std::string("{update, ~i}").c_str(), 42);
+	kill_ctx.msg.type = ERL_REG_SEND;
+	ETERM * pid = erl_mk_pid("bench@localhost", 38, 0, 1);
+	kill_ctx.msg.msg = erl_format((char *) std::string("{~w, stop}").c_str(), pid);
+	erl_free_term(pid);
+
+	struct timespec stamp;
+	clock_gettime(CLOCK_REALTIME, &stamp);
+	erl_comm_send_arg send_arg;
+	send_arg.cmd = (char *) "status";
+	send_arg.node = (char *) "bench@localhost";
+	send_arg.cnt = 7;
+	send_arg.stamp = &stamp;
+
+	erl_comm_clock clk[NUM_CLOCK];
+	for (int i = 0; i < NUM_CLOCK; ++i) {
+		erl_comm_clock_init(&clk[i], (erl_comm_clock_t) i);
+	}
+
+	ring_ctx * ring = (ring_ctx *) calloc(1, sizeof(ring_ctx));
+	ring->msg = update_ctx.msg;
+
+	run("populate_recv_arg/update", op_populate_recv_arg, &update_ctx);
+	run("populate_recv_arg/kill", op_populate_recv_arg, &kill_ctx);
+	run("populate_send_arg", op_populate_send_arg, &send_arg);
+	run("parse_recv_buf", op_parse_recv_buf, &update_ctx);
+	run("timespec_to_erltime", op_timespec_to_erltime, &stamp);
+	run("recv_cir_buf/push_pop", op_ring_push_pop, ring);
+	run("erl_comm_clock_read/realtime", op_clock_read, &clk[REALTIME_CLOCK]);
+	run("erl_comm_clock_read/monotonic_raw", op_clock_read, &clk[MONOTONIC_RAW_CLOCK]);
+	run("erl_comm_clock_read/tsc", op_clock_read, &clk[TSC_CLOCK]);
+	run("erl_comm_clock_to_wall/tsc", op_clock_to_wall, &clk[TSC_CLOCK]);
+
+	bench_result base[BENCH_MAX];
+	int base_cnt = (baseline != NULL) ? load_baseline(baseline, base, BENCH_MAX) : 0;
+	if (base_cnt < 0) {
+		return 1;
+	}
+
+	printf("# name ns/op allocs/op eterms/op freelist/op insns/op%s\n", base_cnt > 0 ? " | delta vs baseline" : "");
+	for (int i = 0; i < result_cnt; ++i) {
+		bench_result * r = &results[i];
+		printf("%-36s %10.2f %8.2f %+8.4f %+8.4f ", r->name, r->ns, r->allocs, r->eterms, r->freelist);
+		if (r->insns < 0) {
+			printf("%10s", "-");
+		} else {
+			printf("%10.1f", r->insns);
+		}
+
+		for (int j = 0; j < base_cnt; ++j) {
+			if (strcmp(base[j].name, r->name) == 0) {
+				printf(" |");
+				print_delta("ns", r->ns, base[j].ns);
+				print_delta("allocs", r->allocs, base[j].allocs);
+				print_diff("eterms", r->eterms, base[j].eterms);
+				print_diff("freelist", r->freelist, base[j].freelist);
+				print_delta("insns", r->insns, base[j].insns);
+				break;
+			}
+		}
+		printf("\n");
+	}
+
+	free(ring);
+	erl_free_compound(update_ctx.msg.msg);
+	erl_free_compound(kill_ctx.msg.msg);
+	if (insn_fd >= 0) {
+		close(insn_fd);
+	}
+
+	return 0;
+}
@@ -4,8 +4,264 @@
 #include <erl_interface.h>
 #include <ei.h>
 #include <string>
+#include <string.h>
+#include <stdint.h>
 #include <time.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+#include "global_msg_type.h"
+
+/**
+ * Credit based flow control.
+ * Both directions use the ACK global message type carrying {credit, N}, which grants
+ * the peer N more messages. See erl_comm_flow.erl for the ErLang side.
+ */
+
+/**
+ * @brief	Populate credit grant.
+ *
+ * ### remarks	Build {ACK, {credit, N}} to be sent as raw copy.
+ * ### param	credit	number of messages the peer is allowed to send on top of its current credit.
+ * ### return	an erlang term represents the grant.
+ */
+
+inline ETERM * populate_credit_arg(int credit) {
+	ETERM * grant[2];
+	ETERM * message[2];
+
+	grant[0] = erl_mk_atom("credit");
+	grant[1] = erl_mk_int(credit);
+
+	message[0] = erl_mk_int(ACK);
+	message[1] = erl_mk_tuple(grant, 2);
+
+	ETERM * msg = erl_mk_tuple(message, 2);
+
+	erl_free_term(grant[0]);
+	erl_free_term(grant[1]);
+	erl_free_term(message[0]);
+	erl_free_term(message[1]);
+
+	return msg;
+}
+
+/**
+ * @brief	Parse credit grant.
+ *
+ * ### remarks	Match incoming message against {ACK, {credit, N}}.
+ * ### param [in]	msg   	the received message.
+ * ### param [out]	credit	number of credits granted by peer. 0 if N is not a positive integer.
+ * ### return	true if msg is shaped as a credit grant, false otherwise. malformed grants are to be dropped.
+ */
+
+inline bool parse_credit_arg(ErlMessage * msg, int * credit) {
+	static ETERM * const credit_pattern = erl_format((char *) std::string("{~i, {credit, _}}").c_str(), ACK);
+
+	if (msg != NULL && msg->msg != NULL && erl_match(credit_pattern, msg->msg)) {
+		// same guard as erl_comm_flow:handle_in/2, is_integer(N), N > 0
+		ETERM * n = erl_element(2, erl_element(2, msg->msg));
+		*credit = (ERL_IS_INTEGER(n) && ERL_INT_VALUE(n) > 0) ? ERL_INT_VALUE(n) : 0;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Receive timestamp source.
+ * A raw reading is taken once per receive batch and converted to wall clock only when the
+ * message is handed to the consumer. Raw sources are based against CLOCK_REALTIME and CLOCK_MONOTONIC
+ * at calibration. The receive thread rebases every ERL_COMM_CLOCK_REBASE_NS and measures the tick
+ * rate against CLOCK_MONOTONIC, so NTP slewing and steps are followed. Readers go through a sequence
+ * count and never see a half rebased clock.
+ */
+
+#define ERL_COMM_CLOCK_REBASE_NS 4000000000ll
+
+typedef enum erl_comm_clock_e {
+	REALTIME_CLOCK,      // CLOCK_REALTIME. exact wall clock, most expensive read
+	MONOTONIC_RAW_CLOCK, // CLOCK_MONOTONIC_RAW
+	TSC_CLOCK,           // calibrated time stamp counter. MONOTONIC_RAW_CLOCK without invariant TSC or off x86
+
+	NUM_CLOCK
+} erl_comm_clock_t;
+
+typedef struct erl_comm_clock_s {
+	erl_comm_clock_t src;
+	volatile unsigned int seq; // odd while a rebase is in progress
+	uint64_t raw_base;   // raw reading at last rebase
+	uint64_t wall_base;  // CLOCK_REALTIME at last rebase, ns
+	uint64_t mono_base;  // CLOCK_MONOTONIC at last rebase, ns. the OS source of erlang monotonic time
+	double ns_per_tick;  // CLOCK_MONOTONIC ns per raw tick. 1.0 for REALTIME_CLOCK
+} erl_comm_clock;
+
+inline uint64_t erl_comm_clock_ns(clockid_t id) {
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief	Read raw clock. cheap enough to be taken once per receive batch.
+ */
+
+inline uint64_t erl_comm_clock_read(const erl_comm_clock * clk) {
+	switch (clk->src) {
+#if defined(__x86_64__) || defined(__i386__)
+	case TSC_CLOCK:
+		return __rdtsc();
+#endif
+	case MONOTONIC_RAW_CLOCK:
+		return erl_comm_clock_ns(CLOCK_MONOTONIC_RAW);
+	case REALTIME_CLOCK:
+	default:
+		return erl_comm_clock_ns(CLOCK_REALTIME);
+	}
+}
+
+/**
+ * @brief	True if the time stamp counter ticks at a constant rate through frequency and sleep state changes.
+ */
+
+inline bool erl_comm_clock_tsc_invariant(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+
+	// CPUID 0x80000007, EDX bit 8
+	if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+		return (edx & (1u << 8)) != 0;
+	}
+#endif
+	return false;
+}
+
+/**
+ * @brief	Select and calibrate clock source. TSC_CLOCK spins for about 10 ms to measure the tick rate.
+ */
+
+inline void erl_comm_clock_init(erl_comm_clock * clk, erl_comm_clock_t src) {
+	if (src == TSC_CLOCK && !erl_comm_clock_tsc_invariant()) {
+		src = MONOTONIC_RAW_CLOCK;
+	}
+	clk->src = src;
+	clk->seq = 0;
+	clk->ns_per_tick = 1.0;
+
+	if (src == TSC_CLOCK) {
+		uint64_t ns0 = erl_comm_clock_ns(CLOCK_MONOTONIC_RAW);
+		uint64_t tsc0 = erl_comm_clock_read(clk);
+		uint64_t ns1;
+		do {
+			ns1 = erl_comm_clock_ns(CLOCK_MONOTONIC_RAW);
+		} while (ns1 - ns0 < 10000000ull);
+		uint64_t tsc1 = erl_comm_clock_read(clk);
+
+		clk->ns_per_tick = (tsc1 > tsc0) ? (double) (ns1 - ns0) / (double) (tsc1 - tsc0) : 1.0;
+	}
+
+	clk->raw_base = erl_comm_clock_read(clk);
+	clk->wall_base = erl_comm_clock_ns(CLOCK_REALTIME);
+	clk->mono_base = erl_comm_clock_ns(CLOCK_MONOTONIC);
+}
+
+/**
+ * @brief	Nanoseconds elapsed between last rebase and raw reading. negative for readings taken before it.
+ */
+
+inline int64_t erl_comm_clock_elapsed(const erl_comm_clock * clk, uint64_t raw) {
+	int64_t ticks = (int64_t) (raw - clk->raw_base);
+	return (clk->src == REALTIME_CLOCK) ? ticks : (int64_t) ((double) ticks * clk->ns_per_tick);
+}
+
+/**
+ * @brief	Consistent copy of clk, retried while the receive thread rebases it.
+ */
+
+inline void erl_comm_clock_load(const erl_comm_clock * clk, erl_comm_clock * snap) {
+	unsigned int seq;
+	do {
+		seq = clk->seq;
+		__sync_synchronize();
+		snap->src = clk->src;
+		snap->raw_base = clk->raw_base;
+		snap->wall_base = clk->wall_base;
+		snap->mono_base = clk->mono_base;
+		snap->ns_per_tick = clk->ns_per_tick;
+		__sync_synchronize();
+	} while ((seq & 1) || seq != clk->seq);
+}
+
+/**
+ * @brief	Re-tie bases to the system clocks and re-measure the tick rate once ERL_COMM_CLOCK_REBASE_NS passed.
+ *          single writer, the receive thread. raw is the reading it just took.
+ *
+ * @return	true if rebased.
+ */
+
+inline bool erl_comm_clock_rebase(erl_comm_clock * clk, uint64_t raw) {
+	int64_t since = erl_comm_clock_elapsed(clk, raw);
+	if (since >= 0 && since < ERL_COMM_CLOCK_REBASE_NS) {
+		return false;
+	}
+
+	uint64_t mono = erl_comm_clock_ns(CLOCK_MONOTONIC);
+	uint64_t now = erl_comm_clock_read(clk);
+	uint64_t wall = erl_comm_clock_ns(CLOCK_REALTIME);
+
+	// NTP slews CLOCK_MONOTONIC by at most 500 ppm. anything further off is a suspend or a bad sample
+	double rate = clk->ns_per_tick;
+	if (clk->src != REALTIME_CLOCK && now > clk->raw_base && mono > clk->mono_base) {
+		double measured = (double) (mono - clk->mono_base) / (double) (now - clk->raw_base);
+		if (measured > rate * 0.99 && measured < rate * 1.01) {
+			rate = measured;
+		}
+	}
+
+	clk->seq = clk->seq + 1;
+	__sync_synchronize();
+	clk->raw_base = now;
+	clk->wall_base = wall;
+	clk->mono_base = mono;
+	clk->ns_per_tick = rate;
+	__sync_synchronize();
+	clk->seq = clk->seq + 1;
+
+	return true;
+}
+
+/**
+ * @brief	Convert raw reading to wall clock.
+ */
+
+inline void erl_comm_clock_to_wall(const erl_comm_clock * clk, uint64_t raw, struct timespec * ts) {
+	uint64_t ns = raw;
+	if (clk->src != REALTIME_CLOCK) {
+		erl_comm_clock snap;
+		erl_comm_clock_load(clk, &snap);
+		ns = snap.wall_base + erl_comm_clock_elapsed(&snap, raw);
+	}
+	ts->tv_sec = ns / 1000000000ull;
+	ts->tv_nsec = ns % 1000000000ull;
+}
+
+/**
+ * @brief	Convert raw reading to CLOCK_MONOTONIC ns, comparable to erlang:system_info(os_monotonic_time_source).
+ */
+
+inline uint64_t erl_comm_clock_to_mono(const erl_comm_clock * clk, uint64_t raw) {
+	erl_comm_clock snap;
+	erl_comm_clock_load(clk, &snap);
+
+	if (snap.src == REALTIME_CLOCK) {
+		return snap.mono_base + (int64_t) (raw - snap.wall_base);
+	}
+	return snap.mono_base + erl_comm_clock_elapsed(&snap, raw);
+}
+
 /**
  * By default, do not use IMPORT_DEF for such argument definition passing
  */
@@ -30,8 +286,19 @@ typedef struct update_s {
 	int update_node;
 } update_t;
 
+/**
+ * Owned copy of a pid. Received terms are released as soon as a message is parsed,
+ * so anything kept in the receive ring must not point into them.
+ */
+typedef struct erl_comm_pid_s {
+	char node[MAXATOMLEN + 1];
+	unsigned int number;
+	unsigned int serial;
+	unsigned char creation;
+} erl_comm_pid;
+
 typedef struct stop_s{
-	ETERM * kill_Pid;
+	erl_comm_pid kill_Pid;
 } stop_t;
 
 typedef struct erl_comm_recv_arg_s {
@@ -40,7 +307,8 @@ typedef struct erl_comm_recv_arg_s {
 		update_t updateMsg;
 		stop_t stopMsg;
 	} msg_val;
-	struct timespec ts;
+	struct timespec ts;  // wall clock, filled from stamp when the message is handed out
+	uint64_t stamp;      // raw receive batch reading, see erl_comm_clock
 	bool read_ready;
 } erl_comm_recv_arg;
 
@@ -79,27 +347,29 @@ inline bool populate_recv_arg(
 			buf->type = UPDATE;
 			buf->msg_val.updateMsg.update_node = ERL_INT_VALUE(erl_element(2, msg->msg));
 			//buf->msg_val.updateMsg.update_term = ERL_ATOM_PTR(arg[0]);
-			clock_gettime(CLOCK_REALTIME, &(buf->ts));
 #ifdef ERL_COMM_DEBUG
 			fprintf(def_log, "update message received. type %d-%d node %d-%d\n", UPDATE, buf->type, ERL_INT_VALUE(erl_element(2, msg->msg)), buf->msg_val.updateMsg.update_node);
-			fprintf(def_log, "timestamp %llu.%llu\n", (long long unsigned) buf->ts.tv_sec, buf->ts.tv_nsec);
 			fflush(def_log);
 #endif
 			
 			buf->read_ready = true;
 			return true;
-		} else if (erl_match(stop_pattern, msg->msg)) {
+		} else if (erl_match(stop_pattern, msg->msg) && ERL_IS_PID(erl_element(1, msg->msg))) {
+
+			ETERM * pid = erl_element(1, msg->msg);
+			erl_comm_pid * kill_Pid = &buf->msg_val.stopMsg.kill_Pid;
 
 			buf->type = KILL;
-			buf->msg_val.stopMsg.kill_Pid = erl_element(1, msg->msg);
+			strncpy(kill_Pid->node, ERL_PID_NODE(pid), sizeof(kill_Pid->node) - 1);
+			kill_Pid->node[sizeof(kill_Pid->node) - 1] = '\0';
+			kill_Pid->number = ERL_PID_NUMBER(pid);
+			kill_Pid->serial = ERL_PID_SERIAL(pid);
+			kill_Pid->creation = ERL_PID_CREATION(pid);
 			//buf->msg_val.updateMsg.update_term = ERL_ATOM_PTR(arg[1]);
-			clock_gettime(CLOCK_REALTIME, &(buf->ts));
 #ifdef ERL_COMM_DEBUG
 			fprintf(def_log, "kill message received. type %d-%d pid ", KILL, buf->type);
-			erl_print_term(def_log, erl_element(1, msg->msg));
-			fprintf(def_log, "-");
-			erl_print_term(def_log, buf->msg_val.stopMsg.kill_Pid);
-			fprintf(def_log, "\n");
+			erl_print_term(def_log, pid);
+			fprintf(def_log, "-<%s.%u.%u>\n", kill_Pid->node, kill_Pid->number, kill_Pid->serial);
 			fflush(def_log);
 #endif
 			
@@ -122,6 +392,40 @@ inline bool populate_recv_arg(
 	return false;
 }
 
+/**
+ * @fn	inline ETERM * erl_comm_mk_pid(const erl_comm_pid * pid)
+ *
+ * @brief	Rebuild an erlang pid term from its owned copy, e.g. to send to a KILL pid.
+ *
+ * @param [in]	pid	the owned pid.
+ *
+ * @return	an erlang pid term. caller frees it with erl_free_term.
+ */
+
+inline ETERM * erl_comm_mk_pid(const erl_comm_pid * pid) {
+	return erl_mk_pid(pid->node, pid->number, pid->serial, pid->creation);
+}
+
+/**
+ * @brief	Decode one term, version magic included, which must end within len bytes.
+ *
+ * ### remarks	erl_decode has no length bound of its own. the term is walked with ei_skip_term first.
+ * ### param [in]	buf	encoded term.
+ * ### param	len		bytes available at buf.
+ * ### return	the decoded term, NULL if malformed or longer than len.
+ */
+
+inline ETERM * erl_comm_decode(const unsigned char * buf, unsigned int len) {
+	int index = 0, version;
+
+	if (len == 0 || ei_decode_version((const char *) buf, &index, &version) < 0
+		|| ei_skip_term((const char *) buf, &index) < 0 || (unsigned int) index > len) {
+		return NULL;
+	}
+
+	return erl_decode((unsigned char *) buf);
+}
+
 /**
  * @fn	inline void timespec_to_erltime(long int& sec, long int& usec, long int& erl_megsec)
  *
@@ -131,7 +435,7 @@ inline bool populate_recv_arg(
  * @date	16/01/2014
  *
  * @param [in,out]	sec		  	The second.
- * @param [in,out]	usec	  	The nano second.
+ * @param [in,out]	usec	  	in: the nano second of timespec. out: the micro second.
  * @param [in,out]	erl_megsec	The megasecond representation.
  *
  * ### remarks	Awang, 16/01/2014.
@@ -140,7 +444,7 @@ inline bool populate_recv_arg(
 inline void timespec_to_erltime(long int& sec, long int& usec, long int& erl_megsec) {
 	erl_megsec = sec / 1000000; // ErLang megasecond is simple 1 million seconds
 	sec = sec % 1000000;        // ErLang second is part less than 1 mill seconds
-	usec = usec;                // ErLang usec is the same as timespec usec
+	usec = usec / 1000;         // ErLang usec is timespec nsec in micro seconds
 }
 
 /**
@@ -205,6 +509,7 @@ inline bool parse_recv_buf(erl_comm_recv_arg * dst, erl_comm_recv_arg * src) {
 		src->read_ready = false;
 		dst->type = src->type;
 		dst->ts = src->ts;
+		dst->stamp = src->stamp;
 		switch(dst->type) {
 		case UPDATE:
 			dst->msg_val.updateMsg.update_node = src->msg_val.updateMsg.update_node;
@@ -0,0 +1,102 @@
+%%
+%% This file contains the ErLang side of the credit based flow control spoken by tFrame_erl_comm.
+%% Both directions use the ACK global message type: {?ACK, {credit, N}} grants the peer N more messages.
+%% Receiver grants credits as its consumer drains. Sender queues outbound messages while out of credit
+%% and flushes them as a batch on the next grant.
+%% Peer is either the C node ({Name, Node} or pid) or, for PORT_TRANSPORT, the port opened with
+%% open_port({spawn_executable, Path}, [{packet, 4}, binary, use_stdio]).
+%%
+
+-module(erl_comm_flow).
+
+-include("global_msg_type.hrl").
+
+-export([new/1, new/2, handle_in/2, consumed/2, send/2, credit/1, pending/1]).
+
+-record(flow, {
+	peer,                    %% C node to talk to. {Name, Node}, pid or port
+	send_credit = 0,         %% messages allowed toward peer before queueing
+	recv_window,             %% credits granted to peer up front
+	grant_threshold,         %% drained messages before credits are granted back
+	recv_drained = 0,        %% drained messages not yet granted back
+	out = queue:new()        %% messages held while out of credit
+}).
+
+%% defaults match erl_comm_default_opt() in erl_comm.h
+-define(DEFAULT_RECV_WINDOW, 512).
+-define(DEFAULT_GRANT_THRESHOLD, 128).
+
+%% @doc create flow state toward Peer and grant it the receive window.
+new(Peer) ->
+	new(Peer, []).
+
+new(Peer, Opts) ->
+	Window = proplists:get_value(recv_window, Opts, ?DEFAULT_RECV_WINDOW),
+	Threshold = proplists:get_value(grant_threshold, Opts, ?DEFAULT_GRANT_THRESHOLD),
+	State = #flow{peer = Peer,
+		send_credit = proplists:get_value(send_window, Opts, 0),
+		recv_window = Window,
+		grant_threshold = erlang:min(Threshold, Window)},
+	grant(Window, State),
+	State.
+
+%% @doc classify a message received from peer.
+%% credit grants are consumed here and release held messages. everything else is to be delivered.
+%% delivered messages must be reported back through consumed/2 once drained.
+handle_in({Port, {data, Bin}}, State = #flow{peer = Port}) when is_port(Port) ->
+	handle_in(binary_to_term(Bin), State);
+handle_in({?ACK, {credit, N}}, State = #flow{send_credit = Credit}) when is_integer(N), N > 0 ->
+	{credit, flush(State#flow{send_credit = Credit + N})};
+handle_in(Msg, State) ->
+	{deliver, Msg, State}.
+
+%% @doc report N delivered messages as drained. grants credits once threshold is reached.
+consumed(N, State = #flow{recv_drained = Drained, grant_threshold = Threshold}) ->
+	case Drained + N of
+		Total when Total >= Threshold ->
+			grant(Total, State),
+			State#flow{recv_drained = 0};
+		Total ->
+			State#flow{recv_drained = Total}
+	end.
+
+%% @doc send Msg to peer if credit allows, otherwise hold it for the next grant.
+send(Msg, State = #flow{send_credit = Credit, out = Out}) ->
+	case queue:is_empty(Out) andalso Credit > 0 of
+		true ->
+			deliver(Msg, State),
+			{ok, State#flow{send_credit = Credit - 1}};
+		false ->
+			{queued, State#flow{out = queue:in(Msg, Out)}}
+	end.
+
+%% @doc remaining send credit.
+credit(#flow{send_credit = Credit}) ->
+	Credit.
+
+%% @doc number of messages held while out of credit.
+pending(#flow{out = Out}) ->
+	queue:len(Out).
+
+%% internal
+
+flush(State = #flow{send_credit = 0}) ->
+	State;
+flush(State = #flow{send_credit = Credit, out = Out}) ->
+	case queue:out(Out) of
+		{{value, Msg}, Rest} ->
+			deliver(Msg, State),
+			flush(State#flow{send_credit = Credit - 1, out = Rest});
+		{empty, _} ->
+			State
+	end.
+
+grant(N, State) ->
+	deliver({?ACK, {credit, N}}, State).
+
+deliver(Msg, #flow{peer = Port}) when is_port(Port) ->
+	true = port_command(Port, term_to_binary(Msg)),
+	ok;
+deliver(Msg, #flow{peer = Peer}) ->
+	Peer ! Msg,
+	ok.
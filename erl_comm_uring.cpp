@@ -0,0 +1,687 @@
+#include "../include/erl_comm_uring.h"
+
+#ifdef ERL_COMM_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "../include/erl_comm_def.h"
+#include "../include/global_err_msg.h"
+
+#define DIST_PASS_THROUGH 112   // 'p', leads every frame when no atom cache is negotiated
+#define URING_BGID        0x2a  // provided buffer group id
+#define URING_NEED_MORE   -100  // staging does not hold a complete frame yet
+
+#define URING_RECV_TAG    1
+#define URING_SEND_TAG    2
+#define URING_WAKE_TAG    3
+#define URING_PROBE_TAG   4
+
+/**
+ * @brief	grow buf to hold at least need bytes.
+ *
+ * @return	false if out of memory or need is beyond what doubling reaches. buf is left untouched.
+ */
+
+static bool reserve(char ** buf, unsigned int * cap, unsigned int need) {
+	if (need <= *cap) {
+		return true;
+	}
+
+	unsigned int size = (*cap > 0) ? *cap : URING_BUF_SIZE;
+	while (size < need) {
+		if (size > UINT_MAX / 2) {
+			return false;
+		}
+		size *= 2;
+	}
+
+	char * grown = (char *) realloc(*buf, size);
+	if (grown == NULL) {
+		return false;
+	}
+
+	*buf = grown;
+	*cap = size;
+	return true;
+}
+
+/**
+ * @fn	tFrame_erl_uring::tFrame_erl_uring(int fd, unsigned int length, unsigned int entries, int send_batch)
+ *
+ * @brief	Constructor. check ready() before use.
+ *
+ * @param	fd			connected distribution socket.
+ * @param	length		maximum frame size accepted, same limit erl_receive_msg applies.
+ * @param	entries		submission queue depth of each ring.
+ * @param	send_batch	number of queued frames submitted as one send.
+ */
+
+tFrame_erl_uring::tFrame_erl_uring(int fd, unsigned int length, unsigned int entries, int send_batch) {
+	_fd = fd;
+	_length = length;
+	_batch = (send_batch > 0) ? send_batch : 1;
+	_ready = _ring_init = _sring_init = _closed = false;
+	_stopping = false;
+	_batch_cnt = 0;
+
+	_br = NULL;
+	_bufs = NULL;
+	pthread_mutex_init(&_rq_mt, NULL);
+	pthread_mutex_init(&_sq_mt, NULL);
+
+	_stage = NULL;
+	_stage_off = _stage_len = _stage_cap = 0;
+	_skip = 0;
+	_pending = _inflight = NULL;
+	_pending_len = _pending_cap = 0;
+	_pending_cnt = 0;
+	_watched = false;
+	_inflight_off = _inflight_len = _inflight_cap = 0;
+
+	if (io_uring_queue_init(entries, &_ring, 0) < 0) {
+		return;
+	}
+	_ring_init = true;
+
+	if (io_uring_queue_init(entries, &_sring, 0) < 0) {
+		return;
+	}
+	_sring_init = true;
+
+	// waiting with a timeout must not consume a submission entry, wake ups share the queue
+	if (!(_ring.features & IORING_FEAT_EXT_ARG)) {
+		return;
+	}
+
+	int ret;
+	_br = io_uring_setup_buf_ring(&_ring, URING_BUF_CNT, URING_BGID, 0, &ret);
+	_bufs = (unsigned char *) malloc(URING_BUF_CNT * URING_BUF_SIZE);
+	if (_br == NULL || _bufs == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < URING_BUF_CNT; ++i) {
+		io_uring_buf_ring_add(_br, _bufs + i * URING_BUF_SIZE, URING_BUF_SIZE, i, io_uring_buf_ring_mask(URING_BUF_CNT), i);
+	}
+	io_uring_buf_ring_advance(_br, URING_BUF_CNT);
+
+	// 5.19 has buffer rings and EXT_ARG but fails multishot recv with -EINVAL. find out before taking the socket
+	_ready = _probe_recv() && _arm_recv();
+}
+
+tFrame_erl_uring::~tFrame_erl_uring() {
+	if (_ring_init) {
+		if (_br != NULL) {
+			io_uring_free_buf_ring(&_ring, _br, URING_BUF_CNT, URING_BGID);
+		}
+		io_uring_queue_exit(&_ring);
+	}
+	if (_sring_init) {
+		io_uring_queue_exit(&_sring);
+	}
+
+	pthread_mutex_destroy(&_rq_mt);
+	pthread_mutex_destroy(&_sq_mt);
+	free(_bufs);
+	free(_stage);
+	free(_pending);
+	free(_inflight);
+}
+
+bool tFrame_erl_uring::ready(void) {
+	return _ready;
+}
+
+bool tFrame_erl_uring::closed(void) {
+	return _closed;
+}
+
+unsigned long tFrame_erl_uring::batch(void) {
+	return _batch_cnt;
+}
+
+/* receive definitions */
+
+/**
+ * @fn	int tFrame_erl_uring::receive_msg(ErlMessage * msg)
+ *
+ * @brief	Hand out the next staged frame, waiting on completions only when none is complete.
+ *
+ * @param [in,out]	msg	receives the decoded message.
+ *
+ * @return	ERL_TICK, ERL_MSG or ERL_ERROR. closed() tells a dead connection from a bad frame.
+ */
+
+int tFrame_erl_uring::receive_msg(ErlMessage * msg) {
+	int got;
+
+	while ((got = _parse_frame(msg)) == URING_NEED_MORE) {
+		if (_closed || _reap() < 0) {
+			return ERL_ERROR;
+		}
+	}
+
+	return got;
+}
+
+/**
+ * @fn	int tFrame_erl_uring::_parse_frame(ErlMessage * msg)
+ *
+ * @brief	Split one frame off the staging buffer. ticks are answered here as erl_receive_msg does.
+ *
+ * @return	ERL_TICK, ERL_MSG, ERL_ERROR, or URING_NEED_MORE if no complete frame is staged.
+ */
+
+int tFrame_erl_uring::_parse_frame(ErlMessage * msg) {
+	unsigned int avail = _stage_len - _stage_off;
+	unsigned char * p = _stage + _stage_off;
+
+	if (avail < 4) {
+		return URING_NEED_MORE;
+	}
+
+	unsigned int len = ((unsigned int) p[0] << 24) | ((unsigned int) p[1] << 16) | ((unsigned int) p[2] << 8) | p[3];
+	if (len == 0) {
+		static const char tick[4] = {0, 0, 0, 0};
+
+		_stage_off += 4;
+		pthread_mutex_lock(&_sq_mt);
+		_reap_send(false);
+		if (reserve(&_pending, &_pending_cap, _pending_len + 4)) {
+			memcpy(_pending + _pending_len, tick, 4);
+			_pending_len += 4;
+			if (_inflight_len == 0) {
+				_submit_pending();
+			}
+		}
+		pthread_mutex_unlock(&_sq_mt);
+		return ERL_TICK;
+	}
+
+	if (len > _length) {
+		// oversized frames are never staged. what is here is dropped, the rest as it arrives
+		unsigned int take = (avail - 4 < len) ? avail - 4 : len;
+		_stage_off += 4 + take;
+		_skip = len - take;
+		return ERL_ERROR;
+	}
+
+	if (avail - 4 < len) {
+		return URING_NEED_MORE;
+	}
+
+	_stage_off += 4 + len;
+
+	return _decode_frame((const char *) p + 4, len, msg);
+}
+
+/**
+ * @fn	int tFrame_erl_uring::_decode_frame(const char * buf, unsigned int len, ErlMessage * msg)
+ *
+ * @brief	Decode 'p', control tuple and message of one frame. only SEND and REG_SEND carry a message.
+ *
+ * @return	ERL_MSG or ERL_ERROR. nothing is left allocated on error.
+ */
+
+int tFrame_erl_uring::_decode_frame(const char * buf, unsigned int len, ErlMessage * msg) {
+	int index = 1, version, arity;
+	long tag;
+	erlang_pid pid;
+
+	msg->msg = msg->from = msg->to = NULL;
+	msg->to_name[0] = '\0';
+
+	if ((unsigned char) buf[0] != DIST_PASS_THROUGH ||
+		ei_decode_version(buf, &index, &version) ||
+		ei_decode_tuple_header(buf, &index, &arity) ||
+		ei_decode_long(buf, &index, &tag)) {
+		return ERL_ERROR;
+	}
+
+	msg->type = tag;
+	switch (tag) {
+	case ERL_REG_SEND: // {6, From, Cookie, ToName}
+		if (arity != 4 || ei_decode_pid(buf, &index, &pid) || ei_skip_term(buf, &index) || ei_decode_atom(buf, &index, msg->to_name)) {
+			return ERL_ERROR;
+		}
+		msg->from = erl_mk_pid(pid.node, pid.num, pid.serial, pid.creation);
+		break;
+	case ERL_SEND: // {2, Cookie, ToPid}
+		if (arity != 3 || ei_skip_term(buf, &index) || ei_decode_pid(buf, &index, &pid)) {
+			return ERL_ERROR;
+		}
+		msg->to = erl_mk_pid(pid.node, pid.num, pid.serial, pid.creation);
+		break;
+	default:
+		// link, exit and the like carry nothing erl_comm consumes
+		return ERL_MSG;
+	}
+
+	if ((unsigned int) index >= len || (msg->msg = erl_comm_decode((const unsigned char *) buf + index, len - index)) == NULL) {
+		if (msg->from) {
+			erl_free_term(msg->from);
+			msg->from = NULL;
+		}
+		if (msg->to) {
+			erl_free_term(msg->to);
+			msg->to = NULL;
+		}
+		return ERL_ERROR;
+	}
+
+	return ERL_MSG;
+}
+
+/**
+ * @fn	int tFrame_erl_uring::_reap(void)
+ *
+ * @brief	Wait for completions and drain all of them. received bytes are staged, wake ups are dropped.
+ *          while sends are outstanding, the wait is bounded so a batch that is not full is not held back for long.
+ *          senders wake the wait up when they leave frames outstanding, so the bound is picked up at once.
+ *
+ * @return	0 if succeeds, -1 once the connection is closed or stop() was called.
+ */
+
+int tFrame_erl_uring::_reap(void) {
+	struct io_uring_cqe * cqe;
+	struct __kernel_timespec linger = {0, 1000000};
+	unsigned int head, seen = 0;
+	bool rearm = false;
+
+	pthread_mutex_lock(&_sq_mt);
+	bool lingering = _watched = (_pending_len > 0 || _inflight_len > 0);
+	pthread_mutex_unlock(&_sq_mt);
+
+	int ret = lingering ? io_uring_wait_cqe_timeout(&_ring, &cqe, &linger) : io_uring_wait_cqe(&_ring, &cqe);
+
+	// whatever ended the wait, sends move along
+	_pump();
+
+	if (_stopping) {
+		_closed = true;
+		return -1;
+	} else if (ret == -ETIME) {
+		return 0;
+	} else if (ret < 0 && ret != -EINTR) {
+		_closed = true;
+		return -1;
+	}
+
+	++_batch_cnt;
+
+	// compact before appending so staging does not creep
+	if (_stage_off > 0) {
+		memmove(_stage, _stage + _stage_off, _stage_len - _stage_off);
+		_stage_len -= _stage_off;
+		_stage_off = 0;
+	}
+
+	io_uring_for_each_cqe(&_ring, head, cqe) {
+		++seen;
+
+		if (io_uring_cqe_get_data64(cqe) == URING_WAKE_TAG) {
+			continue;
+		}
+
+		if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+			unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			unsigned int res = cqe->res;
+
+			// tail of an oversized frame
+			unsigned int skip = (_skip < res) ? _skip : res;
+			_skip -= skip;
+			res -= skip;
+
+			if (reserve((char **) &_stage, &_stage_cap, _stage_len + res)) {
+				memcpy(_stage + _stage_len, _bufs + bid * URING_BUF_SIZE + skip, res);
+				_stage_len += res;
+			} else {
+				_closed = true;
+			}
+
+			io_uring_buf_ring_add(_br, _bufs + bid * URING_BUF_SIZE, URING_BUF_SIZE, bid, io_uring_buf_ring_mask(URING_BUF_CNT), 0);
+			io_uring_buf_ring_advance(_br, 1);
+		} else if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+			// peer closed or socket failed
+			_closed = true;
+		}
+
+		// multishot ends on ENOBUFS and errors. rearm unless the connection is gone
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			rearm = true;
+		}
+	}
+	io_uring_cq_advance(&_ring, seen);
+
+	if (rearm && !_closed && !_arm_recv()) {
+		_closed = true;
+	}
+
+	return _closed ? -1 : 0;
+}
+
+/**
+ * @fn	bool tFrame_erl_uring::_arm_recv(void)
+ *
+ * @brief	Submit the multishot receive into the provided buffer group.
+ */
+
+bool tFrame_erl_uring::_arm_recv(void) {
+	pthread_mutex_lock(&_rq_mt);
+	struct io_uring_sqe * sqe = _get_sqe(&_ring);
+	if (sqe != NULL) {
+		io_uring_prep_recv_multishot(sqe, _fd, NULL, 0, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		io_uring_sqe_set_data64(sqe, URING_RECV_TAG);
+		io_uring_submit(&_ring);
+	}
+	pthread_mutex_unlock(&_rq_mt);
+
+	return sqe != NULL;
+}
+
+/**
+ * @fn	bool tFrame_erl_uring::_probe_recv(void)
+ *
+ * @brief	Check multishot recv into the provided buffer group works, on a socket pair. construction only.
+ *
+ * @return	true if a byte and the end of stream came back as multishot completions.
+ */
+
+bool tFrame_erl_uring::_probe_recv(void) {
+	int sv[2];
+	bool got = false, more = true;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		return false;
+	}
+
+	struct io_uring_sqe * sqe = io_uring_get_sqe(&_ring);
+	if (sqe != NULL) {
+		io_uring_prep_recv_multishot(sqe, sv[0], NULL, 0, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		io_uring_sqe_set_data64(sqe, URING_PROBE_TAG);
+		io_uring_submit(&_ring);
+
+		if (write(sv[1], "p", 1) == 1 && shutdown(sv[1], SHUT_WR) == 0) {
+			struct io_uring_cqe * cqe;
+			struct __kernel_timespec wait = {1, 0};
+
+			// byte, then end of stream which ends the multishot. unsupported kernels end it with -EINVAL
+			while (more && io_uring_wait_cqe_timeout(&_ring, &cqe, &wait) == 0) {
+				if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+					unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+					io_uring_buf_ring_add(_br, _bufs + bid * URING_BUF_SIZE, URING_BUF_SIZE, bid, io_uring_buf_ring_mask(URING_BUF_CNT), 0);
+					io_uring_buf_ring_advance(_br, 1);
+					got = got || (cqe->flags & IORING_CQE_F_MORE);
+				}
+				more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+				io_uring_cqe_seen(&_ring, cqe);
+			}
+		}
+	}
+
+	// a recv still armed completes on shutdown. the ring is torn down anyway if the probe failed
+	shutdown(sv[0], SHUT_RDWR);
+	close(sv[0]);
+	close(sv[1]);
+
+	return got && !more;
+}
+
+/**
+ * @fn	void tFrame_erl_uring::_wake(void)
+ *
+ * @brief	Complete a nop on the receive ring so a receive thread waiting there returns and looks around.
+ */
+
+void tFrame_erl_uring::_wake(void) {
+	pthread_mutex_lock(&_rq_mt);
+	struct io_uring_sqe * sqe = _get_sqe(&_ring);
+	if (sqe != NULL) {
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data64(sqe, URING_WAKE_TAG);
+		io_uring_submit(&_ring);
+	}
+	pthread_mutex_unlock(&_rq_mt);
+}
+
+void tFrame_erl_uring::stop(void) {
+	_stopping = true;
+	_wake();
+}
+
+/**
+ * @brief	Get a submission entry of ring, flushing its queue once if it is full. the ring's mutex must be held.
+ */
+
+struct io_uring_sqe * tFrame_erl_uring::_get_sqe(struct io_uring * ring) {
+	struct io_uring_sqe * sqe = io_uring_get_sqe(ring);
+	if (sqe == NULL) {
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+	}
+	return sqe;
+}
+
+/* send definitions */
+
+/**
+ * @fn	int tFrame_erl_uring::send_reg(const erlang_pid * from, const char * to_name, const char * buf, int len)
+ *
+ * @brief	Queue {6, From, '', ToName} followed by the encoded message.
+ */
+
+int tFrame_erl_uring::send_reg(const erlang_pid * from, const char * to_name, const char * buf, int len) {
+	ei_x_buff ctl;
+	int rc;
+
+	ei_x_new_with_version(&ctl);
+	ei_x_encode_tuple_header(&ctl, 4);
+	ei_x_encode_long(&ctl, ERL_REG_SEND);
+	ei_x_encode_pid(&ctl, from);
+	ei_x_encode_atom(&ctl, "");
+	ei_x_encode_atom(&ctl, to_name);
+
+	rc = _queue(ctl.buff, ctl.index, buf, len);
+	ei_x_free(&ctl);
+
+	return rc;
+}
+
+/**
+ * @fn	int tFrame_erl_uring::send_pid(const erlang_pid * to, const char * buf, int len)
+ *
+ * @brief	Queue {2, '', ToPid} followed by the encoded message.
+ */
+
+int tFrame_erl_uring::send_pid(const erlang_pid * to, const char * buf, int len) {
+	ei_x_buff ctl;
+	int rc;
+
+	ei_x_new_with_version(&ctl);
+	ei_x_encode_tuple_header(&ctl, 3);
+	ei_x_encode_long(&ctl, ERL_SEND);
+	ei_x_encode_atom(&ctl, "");
+	ei_x_encode_pid(&ctl, to);
+
+	rc = _queue(ctl.buff, ctl.index, buf, len);
+	ei_x_free(&ctl);
+
+	return rc;
+}
+
+void tFrame_erl_uring::flush(void) {
+	pthread_mutex_lock(&_sq_mt);
+	_reap_send(true);
+	if (!_closed && _pending_len > 0) {
+		_submit_pending();
+		_reap_send(true);
+	}
+	pthread_mutex_unlock(&_sq_mt);
+}
+
+/**
+ * @fn	void tFrame_erl_uring::_pump(void)
+ *
+ * @brief	Account finished sends and submit pending frames if nothing is in flight. never waits.
+ */
+
+void tFrame_erl_uring::_pump(void) {
+	pthread_mutex_lock(&_sq_mt);
+	_reap_send(false);
+	if (!_closed && _inflight_len == 0 && _pending_len > 0) {
+		_submit_pending();
+	}
+	pthread_mutex_unlock(&_sq_mt);
+}
+
+/**
+ * @fn	int tFrame_erl_uring::_queue(const char * ctl, int ctl_len, const char * msg, int msg_len)
+ *
+ * @brief	Append one frame to the pending buffer and submit once send_batch frames are queued.
+ *          a full batch waits for the send still in flight, so senders are held back by a slow socket.
+ */
+
+int tFrame_erl_uring::_queue(const char * ctl, int ctl_len, const char * msg, int msg_len) {
+	unsigned int len = 1 + ctl_len + msg_len;
+	int rc = NO_ERROR;
+	bool wake = false;
+
+	pthread_mutex_lock(&_sq_mt);
+	_reap_send(false);
+	if (_closed) {
+		rc = IO_ERROR;
+	} else if (!reserve(&_pending, &_pending_cap, _pending_len + 4 + len)) {
+		rc = GENERIC_ERROR;
+	} else {
+		char * p = _pending + _pending_len;
+		p[0] = (len >> 24) & 0xff;
+		p[1] = (len >> 16) & 0xff;
+		p[2] = (len >> 8) & 0xff;
+		p[3] = len & 0xff;
+		p[4] = DIST_PASS_THROUGH;
+		memcpy(p + 5, ctl, ctl_len);
+		memcpy(p + 5 + ctl_len, msg, msg_len);
+		_pending_len += 4 + len;
+
+		if (++_pending_cnt >= _batch) {
+			// one send in flight at a time keeps the stream in order
+			_reap_send(true);
+			if (!_closed) {
+				_submit_pending();
+			} else {
+				rc = IO_ERROR;
+			}
+		}
+
+		// left outstanding. the receive thread bounds its wait from now on to push it out
+		if (!_watched && (_pending_len > 0 || _inflight_len > 0)) {
+			_watched = wake = true;
+		}
+	}
+	pthread_mutex_unlock(&_sq_mt);
+
+	if (wake) {
+		_wake();
+	}
+
+	return rc;
+}
+
+/**
+ * @fn	void tFrame_erl_uring::_reap_send(bool wait)
+ *
+ * @brief	Account completions of the send ring. _sq_mt must be held.
+ *
+ * @param	wait	true to block until nothing is in flight, false to take only what already completed.
+ */
+
+void tFrame_erl_uring::_reap_send(bool wait) {
+	struct io_uring_cqe * cqe;
+
+	while (_inflight_len > 0) {
+		int ret = wait ? io_uring_wait_cqe(&_sring, &cqe) : io_uring_peek_cqe(&_sring, &cqe);
+		if (ret == -EINTR) {
+			continue;
+		} else if (ret < 0) {
+			// -EAGAIN on peek, nothing completed yet
+			if (wait) {
+				_inflight_len = 0;
+				_closed = true;
+			}
+			break;
+		}
+
+		int res = cqe->res;
+		io_uring_cqe_seen(&_sring, cqe);
+		_send_done(res);
+	}
+}
+
+/**
+ * @brief	Move pending frames in flight as one send. _sq_mt must be held and nothing in flight.
+ */
+
+void tFrame_erl_uring::_submit_pending(void) {
+	char * buf = _inflight;
+	unsigned int cap = _inflight_cap;
+
+	_inflight = _pending;
+	_inflight_cap = _pending_cap;
+	_inflight_len = _pending_len;
+	_inflight_off = 0;
+
+	_pending = buf;
+	_pending_cap = cap;
+	_pending_len = 0;
+	_pending_cnt = 0;
+
+	_submit_send();
+}
+
+/**
+ * @brief	Submit what is left of the in flight buffer. _sq_mt must be held.
+ */
+
+void tFrame_erl_uring::_submit_send(void) {
+	struct io_uring_sqe * sqe = _get_sqe(&_sring);
+	if (sqe == NULL) {
+		_inflight_len = 0;
+		_closed = true;
+		return;
+	}
+
+	io_uring_prep_send(sqe, _fd, _inflight + _inflight_off, _inflight_len - _inflight_off, MSG_NOSIGNAL);
+	io_uring_sqe_set_data64(sqe, URING_SEND_TAG);
+	io_uring_submit(&_sring);
+}
+
+/**
+ * @brief	Account a send completion. short sends are resubmitted. _sq_mt must be held.
+ */
+
+void tFrame_erl_uring::_send_done(int res) {
+	if (res == -EINTR || res == -EAGAIN) {
+		_submit_send();
+	} else if (res < 0) {
+		_inflight_len = 0;
+		_closed = true;
+	} else {
+		_inflight_off += res;
+		if (_inflight_off < _inflight_len) {
+			_submit_send();
+		} else {
+			_inflight_len = 0;
+		}
+	}
+}
+
+#endif // ERL_COMM_URING
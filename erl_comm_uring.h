@@ -0,0 +1,121 @@
+#ifndef ERL_COMM_URING_H
+#define ERL_COMM_URING_H
+
+/**
+ * io_uring backend for the distribution socket. Only built with ERL_COMM_URING (links liburing).
+ *
+ * Receives are one multishot recv into a ring of provided buffers. Completions are copied into a
+ * staging buffer and split into distribution frames there, so many messages are dispatched per wake up.
+ * Outbound frames are appended to a pending buffer and submitted as a single send once send_batch
+ * frames are queued, one send in flight at a time to keep the stream in order.
+ * Sends go through a ring of their own which senders reap themselves, so they progress without the
+ * receive thread. A batch that is not yet full is submitted by the receive thread after about 1ms,
+ * or by flush().
+ */
+
+#ifdef ERL_COMM_URING
+
+#include <erl_interface.h>
+#include <ei.h>
+#include <liburing.h>
+#include <pthread.h>
+
+#define URING_BUF_CNT  64    // provided receive buffers. must be a power of 2
+#define URING_BUF_SIZE 4096  // size of each provided receive buffer
+
+class tFrame_erl_uring {
+public:
+	tFrame_erl_uring(int, unsigned int, unsigned int, int);
+	~tFrame_erl_uring();
+
+	/**
+	 * @brief false if io_uring, provided buffer rings or multishot recv are not available.
+	 *        caller falls back to plain sockets.
+	 */
+	bool ready(void);
+
+	/**
+	 * @brief true once the peer closed the connection or the socket failed.
+	 */
+	bool closed(void);
+
+	/**
+	 * @brief number of completion batches reaped so far. messages staged by the same batch share it.
+	 */
+	unsigned long batch(void);
+
+	/**
+	 * @brief receive one message from the socket, in the same shape erl_receive_msg returns it.
+	 * @output
+	 *      ERL_TICK, ERL_MSG or ERL_ERROR as erl_receive_msg does
+	 */
+	int receive_msg(ErlMessage *);
+
+	/**
+	 * @brief queue a pre-encoded message to a registered name or to a pid.
+	 * @output
+	 *      NO_ERROR if queued, IO_ERROR if the connection is gone
+	 */
+	int send_reg(const erlang_pid *, const char *, const char *, int);
+	int send_pid(const erlang_pid *, const char *, int);
+
+	/**
+	 * @brief submit queued frames without waiting for send_batch, and wait until all of them are written.
+	 */
+	void flush(void);
+
+	/**
+	 * @brief make a receive_msg blocked in another thread return ERL_ERROR, and every later one.
+	 */
+	void stop(void);
+
+protected:
+	int _parse_frame(ErlMessage *);
+	int _decode_frame(const char *, unsigned int, ErlMessage *);
+	int _reap(void);
+	bool _arm_recv(void);
+	bool _probe_recv(void);
+	void _wake(void);
+	struct io_uring_sqe * _get_sqe(struct io_uring *);
+
+	int _queue(const char *, int, const char *, int);
+	void _pump(void);
+	void _reap_send(bool);
+	void _submit_pending(void);
+	void _submit_send(void);
+	void _send_done(int);
+
+private:
+	int _fd;
+	unsigned int _length;
+	int _batch;
+	bool _ready, _ring_init, _sring_init, _closed;
+	volatile bool _stopping;
+	unsigned long _batch_cnt;
+
+	// receive ring. submissions guarded by _rq_mt, completions reaped by the receive thread only
+	struct io_uring _ring;
+	struct io_uring_buf_ring * _br;
+	unsigned char * _bufs;
+	pthread_mutex_t _rq_mt;
+
+	// send ring. submissions and completions guarded by _sq_mt
+	struct io_uring _sring;
+	pthread_mutex_t _sq_mt;
+
+	// received bytes not yet split into frames. receive thread only
+	unsigned char * _stage;
+	unsigned int _stage_off, _stage_len, _stage_cap;
+	unsigned int _skip;  // bytes of an oversized frame still to be dropped
+
+	// outbound frames. guarded by _sq_mt
+	char * _pending;
+	unsigned int _pending_len, _pending_cap;
+	int _pending_cnt;
+	bool _watched;   // receive thread knows sends are outstanding and bounds its wait
+	char * _inflight;
+	unsigned int _inflight_off, _inflight_len, _inflight_cap;
+};
+
+#endif // ERL_COMM_URING
+#endif // ERL_COMM_URING_H
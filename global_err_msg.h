@@ -8,5 +8,6 @@
 #define NOT_HANDLED        -4       // this is to signal the routine shall not be handled by current call.
 #define IO_ERROR           -5       // this is to signal for an I/O error.
 #define PTHREAD_ERROR      -6       // this is to signal thread operation failure.
+#define NO_CREDIT          -7       // this is to signal flow control credit is exhausted.
 
 #endif //GLOBAL_ERR_MSG_H
\ No newline at end of file